@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "AlignedAllocator.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// One bit per agent slot, 64 slots per word.
+// Bits are set and cleared atomically, so threads can update agents sharing a word.
+// Iterating only visits the set bits, skipping whole empty words at once
+class AgentBits
+{
+public:
+
+	// The words are only written by clear_words, so their pages go to the threads clearing them
+	AgentBits(size_t capacity)
+	{
+		words.allocate(word_count(capacity));
+	}
+
+	// Words needed to hold 'agent_count' agents
+	static inline size_t word_count(size_t agent_count)
+	{
+		return (agent_count + bits_per_word - 1) / bits_per_word;
+	}
+
+	// Index of the lowest set bit, word must not be 0
+	static inline int lowest_bit(uint64_t word)
+	{
+#ifdef _MSC_VER
+		unsigned long bit;
+		_BitScanForward64(&bit, word);
+		return (int)bit;
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+	// Number of set bits in the word
+	static inline int bit_count(uint64_t word)
+	{
+#ifdef _MSC_VER
+		return (int)__popcnt64(word);
+#else
+		return __builtin_popcountll(word);
+#endif
+	}
+
+	// Number of set bits in words [first_word, last_word)
+	inline size_t count(size_t first_word, size_t last_word) const
+	{
+		size_t total = 0;
+		for (size_t word = first_word; word < last_word; word++)
+		{
+			total += bit_count(words[word].load(std::memory_order_relaxed));
+		}
+		return total;
+	}
+
+	inline void set(size_t index)
+	{
+		words[index / bits_per_word].fetch_or(uint64_t(1) << (index % bits_per_word), std::memory_order_relaxed);
+	}
+
+	inline void clear(size_t index)
+	{
+		words[index / bits_per_word].fetch_and(~(uint64_t(1) << (index % bits_per_word)), std::memory_order_relaxed);
+	}
+
+	// Replace a whole word at once. Not thread-safe with updates to the same word
+	inline void store_word(size_t word, uint64_t bits)
+	{
+		words[word].store(bits, std::memory_order_relaxed);
+	}
+
+	// Clear words [first_word, last_word), clamped to the words there are.
+	// Every word has to be cleared once before any other use
+	void clear_words(size_t first_word, size_t last_word)
+	{
+		words.construct(std::min(first_word, words.size()), std::min(last_word, words.size()), 0);
+	}
+
+	// Call visit(index) for every set bit of the word, lowest first.
+	// Bits changed while visiting the word are not seen
+	template<typename Visitor>
+	inline void for_each_in_word(size_t word, Visitor&& visit) const
+	{
+		uint64_t bits = words[word].load(std::memory_order_relaxed);
+		while (bits != 0)
+		{
+			visit(word * bits_per_word + lowest_bit(bits));
+			bits &= bits - 1;
+		}
+	}
+
+	static constexpr size_t bits_per_word = 64;
+
+private:
+
+	AtomicArray<uint64_t> words;
+};
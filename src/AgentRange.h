@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+
+// Read-only view over a contiguous run of agent indices,
+// with the x and y coordinates of each agent stored alongside
+struct AgentRange {
+	AgentRange(const size_t* first, const size_t* last, const float* x, const float* y) :
+		first(first), last(last), x(x), y(y)
+	{
+	}
+
+	inline const size_t* begin() const
+	{
+		return first;
+	}
+
+	inline const size_t* end() const
+	{
+		return last;
+	}
+
+	inline size_t size() const
+	{
+		return last - first;
+	}
+
+	inline bool empty() const
+	{
+		return first == last;
+	}
+
+	inline size_t operator[](size_t i) const
+	{
+		return first[i];
+	}
+
+	const size_t* first;
+	const size_t* last;
+	const float* x;
+	const float* y;
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+
+// Size of a cache line, arrays are aligned to it
+constexpr size_t cache_line_size = 64;
+
+// Allocator giving each array its own cache line aligned block,
+// so the first element of every array starts a cache line.
+// Elements are default initialized, so resizing doesn't write to the new memory
+// and each page is placed by the thread that first writes to it
+template<typename T>
+struct AlignedAllocator {
+	using value_type = T;
+
+	AlignedAllocator() = default;
+
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U>&)
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(cache_line_size)));
+	}
+
+	void deallocate(T* pointer, size_t)
+	{
+		::operator delete(pointer, std::align_val_t(cache_line_size));
+	}
+
+	template<typename U, typename... Args>
+	void construct(U* pointer, Args&&... args)
+	{
+		if constexpr (sizeof...(Args) == 0)
+		{
+			::new((void*)pointer) U;
+		}
+		else
+		{
+			::new((void*)pointer) U(std::forward<Args>(args)...);
+		}
+	}
+
+	template<typename U>
+	bool operator==(const AlignedAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template<typename U>
+	bool operator!=(const AlignedAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Cache line aligned array of atomics, allocated without writing to it. Since C++20
+// the default constructor of std::atomic zeroes the value, so an AlignedVector of them
+// is written by the thread that sizes it. Here each part is only constructed by
+// construct, so the thread calling it places its pages
+template<typename T>
+class AtomicArray
+{
+public:
+
+	AtomicArray() = default;
+
+	AtomicArray(const AtomicArray&) = delete;
+
+	AtomicArray& operator=(const AtomicArray&) = delete;
+
+	~AtomicArray()
+	{
+		release();
+	}
+
+	// Room for 'count' elements, none of them constructed. The previous ones are gone
+	void allocate(size_t count)
+	{
+		release();
+		elements = AlignedAllocator<std::atomic<T>>().allocate(count);
+		element_count = count;
+	}
+
+	// Start the lifetime of elements [begin, end), holding 'value'
+	void construct(size_t begin, size_t end, T value)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			::new((void*)(elements + i)) std::atomic<T>(value);
+		}
+	}
+
+	inline std::atomic<T>& operator[](size_t index)
+	{
+		return elements[index];
+	}
+
+	inline const std::atomic<T>& operator[](size_t index) const
+	{
+		return elements[index];
+	}
+
+	inline size_t size() const
+	{
+		return element_count;
+	}
+
+private:
+
+	// Elements are never destroyed, only their memory is released
+	static_assert(std::is_trivially_destructible_v<std::atomic<T>>, "AtomicArray doesn't destroy its elements");
+
+	void release()
+	{
+		if (elements != nullptr)
+		{
+			AlignedAllocator<std::atomic<T>>().deallocate(elements, element_count);
+		}
+		elements = nullptr;
+		element_count = 0;
+	}
+
+	std::atomic<T>* elements = nullptr;
+
+	size_t element_count = 0;
+};
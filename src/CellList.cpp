@@ -0,0 +1,112 @@
+#include "CellList.h"
+#include <algorithm>
+#include <omp.h>
+
+CellList::CellList(float map_size, int divisions, size_t capacity) :
+	divisions_per_dimension(divisions),
+	map_size(map_size),
+	cell_start(divisions * divisions * n_partitions),
+	cell_count(divisions * divisions * n_partitions),
+	sorted_ids(capacity),
+	sorted_x(capacity),
+	sorted_y(capacity),
+	agent_buckets(capacity)
+{
+	cell_size = (map_size * 2.0f) / divisions_per_dimension;
+}
+
+void CellList::rebuild(const AlignedVector<float>& pos_x, const AlignedVector<float>& pos_y, const AtomicArray<State>& states, size_t agent_count)
+{
+	const int buckets = divisions_per_dimension * divisions_per_dimension * n_partitions;
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const size_t begin = agent_count * thread / threads;
+	const size_t end = agent_count * (thread + 1) / threads;
+
+	#pragma omp single
+	{
+		thread_offsets.resize((size_t)buckets * threads);
+	}
+	size_t* offsets = &thread_offsets[(size_t)buckets * thread];
+
+	// 1: Count agents per bucket on this thread's range
+	std::fill(offsets, offsets + buckets, 0);
+	for (size_t i = begin; i < end; i++)
+	{
+		State state = states[i].load();
+		if (state == State::Dead)
+		{
+			agent_buckets[i] = no_bucket;
+			continue;
+		}
+		int bucket = bucket_of(cell_index(vec2f(pos_x[i], pos_y[i])), state);
+		agent_buckets[i] = bucket;
+		offsets[bucket]++;
+	}
+
+	#pragma omp barrier
+
+	// 2: Turn the per thread counts into offsets inside each bucket.
+	// Lower threads go first, so each bucket stays sorted by agent index
+	#pragma omp for
+	for (int bucket = 0; bucket < buckets; bucket++)
+	{
+		size_t total = 0;
+		for (int t = 0; t < threads; t++)
+		{
+			size_t& count = thread_offsets[(size_t)buckets * t + bucket];
+			size_t thread_count = count;
+			count = total;
+			total += thread_count;
+		}
+		cell_count[bucket] = total;
+	}
+
+	#pragma omp single
+	{
+		size_t start = 0;
+		for (int bucket = 0; bucket < buckets; bucket++)
+		{
+			cell_start[bucket] = start;
+			start += cell_count[bucket];
+		}
+	}
+
+	#pragma omp for
+	for (int bucket = 0; bucket < buckets; bucket++)
+	{
+		for (int t = 0; t < threads; t++)
+		{
+			thread_offsets[(size_t)buckets * t + bucket] += cell_start[bucket];
+		}
+	}
+
+	// 3: Scatter this thread's agents into their buckets
+	for (size_t i = begin; i < end; i++)
+	{
+		int bucket = agent_buckets[i];
+		if (bucket != no_bucket)
+		{
+			size_t slot = offsets[bucket]++;
+			sorted_ids[slot] = i;
+			sorted_x[slot] = pos_x[i];
+			sorted_y[slot] = pos_y[i];
+		}
+	}
+
+	#pragma omp barrier
+}
+
+int CellList::cell_index(vec2f position)
+{
+	position.x += map_size;
+	position.y += map_size;
+	int x_pos = std::min((int)(position.x / cell_size), divisions_per_dimension - 1);
+	int y_pos = std::min((int)(position.y / cell_size), divisions_per_dimension - 1);
+	return x_pos + y_pos * divisions_per_dimension;
+}
+
+int CellList::bucket_of(int cell, State state)
+{
+	return cell * n_partitions + (state == State::Hunting ? 1 : 0);
+}
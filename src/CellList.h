@@ -0,0 +1,82 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "vec2f.h"
+#include "State.h"
+#include "AgentRange.h"
+#include "AlignedAllocator.h"
+
+// Spatial index rebuilt from scratch every step.
+// Living agents are counting-sorted by cell into flat arrays, so no
+// per-agent bookkeeping is needed when agents move, split or die.
+// Inside each cell incubating agents come before hunting agents.
+class CellList
+{
+public:
+
+	CellList(float map_size, int divisions, size_t capacity);
+
+	// Sort every living agent in [0, agent_count) into its cell.
+	// Called by every thread of the team, or by a single thread outside a parallel region
+	void rebuild(const AlignedVector<float>& pos_x, const AlignedVector<float>& pos_y, const AtomicArray<State>& states, size_t agent_count);
+
+	// Call visit(AgentRange) with the agents in 'state' of every cell overlapping
+	// the square of half side 'radius' around position. A radius of cell_size visits the 3x3 neighborhood
+	template<typename Visitor>
+	void for_each_near(vec2f position, float radius, State state, Visitor&& visit);
+
+	int cell_index(vec2f position);
+
+	int divisions_per_dimension;
+
+	float cell_size;
+
+	float map_size;
+
+private:
+
+	static constexpr int no_bucket = -1;
+
+	static constexpr int n_partitions = 2;
+
+	// Sorting key of a cell and state, agents are grouped by it
+	static int bucket_of(int cell, State state);
+
+	// First position in sorted_ids of each bucket
+	std::vector<size_t> cell_start;
+
+	// Number of agents in each bucket
+	std::vector<size_t> cell_count;
+
+	// Agent indices grouped by bucket
+	std::vector<size_t> sorted_ids;
+
+	// Coordinates of the agents in sorted_ids
+	std::vector<float> sorted_x;
+	std::vector<float> sorted_y;
+
+	// Bucket of each agent on the last rebuild
+	std::vector<int> agent_buckets;
+
+	// Per thread histogram, turned into per thread write offsets
+	std::vector<size_t> thread_offsets;
+};
+
+template<typename Visitor>
+void CellList::for_each_near(vec2f position, float radius, State state, Visitor&& visit)
+{
+	int min_x = std::max((int)((position.x - radius + map_size) / cell_size), 0);
+	int min_y = std::max((int)((position.y - radius + map_size) / cell_size), 0);
+	int max_x = std::min((int)((position.x + radius + map_size) / cell_size), divisions_per_dimension - 1);
+	int max_y = std::min((int)((position.y + radius + map_size) / cell_size), divisions_per_dimension - 1);
+	for (int y = min_y; y <= max_y; y++)
+	{
+		for (int x = min_x; x <= max_x; x++)
+		{
+			int bucket = bucket_of(x + y * divisions_per_dimension, state);
+			size_t start = cell_start[bucket];
+			visit(AgentRange(sorted_ids.data() + start, sorted_ids.data() + start + cell_count[bucket], sorted_x.data() + start, sorted_y.data() + start));
+		}
+	}
+}
@@ -0,0 +1,134 @@
+#include "Checkpoint.h"
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+
+static_assert(sizeof(CheckpointHeader) == 96, "The checkpoint header is written as is, it can't have padding");
+
+Checkpoint::~Checkpoint()
+{
+	wait();
+}
+
+Snapshot& Checkpoint::snapshot()
+{
+	return current;
+}
+
+void Checkpoint::write_in_background(const std::string& path)
+{
+	wait();
+	writer = std::thread([this, path]()
+	{
+		if (write(path, current))
+		{
+			VLOG(1) << "Checkpoint of step " << current.header.step_count << " written to " << path;
+		}
+	});
+}
+
+void Checkpoint::wait()
+{
+	if (writer.joinable())
+	{
+		writer.join();
+	}
+}
+
+bool Checkpoint::write(const std::string& path, const Snapshot& snapshot)
+{
+	const std::string temporary_path = path + ".tmp";
+	{
+		std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&snapshot.header), sizeof(snapshot.header));
+		for (const std::vector<char>& block : snapshot.blocks)
+		{
+			const uint64_t size = block.size();
+			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+			file.write(block.data(), block.size());
+		}
+		if (!file)
+		{
+			LOG(ERROR) << "Failed to write checkpoint " << temporary_path;
+			return false;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporary_path, path, error);
+	if (error)
+	{
+		LOG(ERROR) << "Failed to move checkpoint to " << path << ": " << error.message();
+		return false;
+	}
+	return true;
+}
+
+bool Checkpoint::read(const std::string& path, Snapshot& snapshot, const BlockSizes& block_sizes)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		LOG(ERROR) << "Failed to open checkpoint " << path;
+		return false;
+	}
+	uint64_t remaining = (uint64_t)file.tellg();
+	file.seekg(0);
+
+	CheckpointHeader& header = snapshot.header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, magic, sizeof(magic)) != 0)
+	{
+		LOG(ERROR) << path << " is not a checkpoint";
+		return false;
+	}
+	if (header.version != version)
+	{
+		LOG(ERROR) << "Checkpoint " << path << " has version " << header.version << ", only version " << version << " can be read";
+		return false;
+	}
+
+	remaining -= sizeof(header);
+
+	const std::vector<uint64_t> expected = block_sizes(header);
+	if (expected.empty())
+	{
+		return false;
+	}
+	if (header.block_count != expected.size())
+	{
+		LOG(ERROR) << "Checkpoint " << path << " has " << header.block_count << " blocks, not " << expected.size();
+		return false;
+	}
+
+	snapshot.blocks.resize(expected.size());
+	for (size_t b = 0; b < expected.size(); b++)
+	{
+		uint64_t size = 0;
+		if (!file.read(reinterpret_cast<char*>(&size), sizeof(size)))
+		{
+			LOG(ERROR) << "Checkpoint " << path << " is truncated";
+			return false;
+		}
+		remaining -= sizeof(size);
+		if (size != expected[b])
+		{
+			LOG(ERROR) << "Block " << b << " of checkpoint " << path << " has " << size << " bytes, not " << expected[b];
+			return false;
+		}
+		if (size > remaining)
+		{
+			LOG(ERROR) << "Checkpoint " << path << " is truncated";
+			return false;
+		}
+		remaining -= size;
+
+		std::vector<char>& block = snapshot.blocks[b];
+		block.resize(size);
+		if (!file.read(block.data(), block.size()))
+		{
+			LOG(ERROR) << "Checkpoint " << path << " is truncated";
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <easylogging/easylogging++.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <thread>
+#include "SimulationParams.h"
+
+// Fixed part of a checkpoint file. Laid out without padding, it is written as is
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_count;
+	uint64_t capacity;			// Agents the simulation has room for
+	uint64_t agent_count;		// Agents in each agent block, last_agent_index
+	uint64_t living_agents;
+	uint64_t step_count;
+	uint64_t state_passes;
+	uint64_t grid_cells;		// Cells of the spatial grid
+	SimulationParams params;
+	uint32_t reserved;
+};
+
+// Simulation state between two steps. The simulation decides what each
+// block holds, the file is the header followed by every block as a byte
+// count and a raw contiguous array.
+struct Snapshot {
+	CheckpointHeader header;
+	std::vector<std::vector<char>> blocks;
+};
+
+// Writes snapshots to disk on a background thread, so the simulation only
+// stops for as long as it takes to copy its arrays into the snapshot
+class Checkpoint
+{
+public:
+
+	~Checkpoint();
+
+	// Snapshot to fill. Only touch it when no write is in progress
+	Snapshot& snapshot();
+
+	// Write the snapshot to 'path' on a background thread. It goes to a
+	// temporary file first, so a crash never leaves a half written checkpoint
+	void write_in_background(const std::string& path);
+
+	// Wait for the background write to finish
+	void wait();
+
+	// Sizes the blocks of a checkpoint must have, given its header. Empty, after
+	// logging why, when the header doesn't fit the one reading it
+	using BlockSizes = std::function<std::vector<uint64_t>(const CheckpointHeader&)>;
+
+	// Read the checkpoint at 'path'. Returns false, after logging why, if it can't be
+	// read, was written by another version or its blocks don't have 'block_sizes'.
+	// Nothing is allocated for a block before its size is checked
+	static bool read(const std::string& path, Snapshot& snapshot, const BlockSizes& block_sizes);
+
+	// Format version, bumped whenever the header or the blocks change
+	static constexpr uint32_t version = 1;
+
+	static constexpr char magic[8] = { 'P', 'A', 'L', 'S', 'C', 'K', 'P', 'T' };
+
+private:
+
+	static bool write(const std::string& path, const Snapshot& snapshot);
+
+	Snapshot current;
+
+	std::thread writer;
+};
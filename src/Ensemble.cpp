@@ -0,0 +1,165 @@
+#include "Ensemble.h"
+#include "Simulation.h"
+#include "Numa.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <omp.h>
+
+Ensemble::Ensemble(int argc, char* argv[], const Settings& settings) :
+	n_threads(settings.n_threads),
+	pin_threads(settings.pin_threads)
+{
+	std::ifstream file(settings.ensemble);
+	if (!file)
+	{
+		LOG(ERROR) << "Failed to open ensemble file " << settings.ensemble;
+		one_per_thread = true;
+		return;
+	}
+
+	// Later flags win, so the ones on a line override the program's
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::vector<std::string> line_args = split_line(line);
+		if (line_args.empty() || line_args[0][0] == '#')
+		{
+			continue;
+		}
+
+		std::vector<std::string> args(argv, argv + argc);
+		args.insert(args.end(), line_args.begin(), line_args.end());
+		std::vector<char*> instance_argv;
+		for (std::string& arg : args)
+		{
+			instance_argv.push_back(arg.data());
+		}
+		instances.emplace_back((int)instance_argv.size(), instance_argv.data());
+	}
+	if (instances.empty())
+	{
+		LOG(ERROR) << "Ensemble file " << settings.ensemble << " has no instances";
+	}
+
+	// Instances don't share anything, so running one per thread needs no syncing at all.
+	// Each one only gets every thread when there are too few of them to keep the
+	// threads busy and they are big enough to be split
+	int most_agents = 0;
+	for (const Settings& instance : instances)
+	{
+		most_agents = std::max(most_agents, instance.n_start_agents);
+	}
+	one_per_thread = n_threads == 1 ||
+		instances.size() >= (size_t)n_threads ||
+		most_agents / n_threads < min_agents_per_thread;
+
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		Settings& instance = instances[i];
+		instance.is_headless = true;
+
+		// Each instance saves to and restores from its own file, suffixed with its number
+		instance.checkpoint_file += "." + std::to_string(i);
+		if (!instance.restore.empty())
+		{
+			instance.restore += "." + std::to_string(i);
+		}
+
+		if (one_per_thread)
+		{
+			// The ensemble's threads are pinned instead, one instance is on a single CPU
+			instance.n_threads = 1;
+			instance.numa = false;
+			instance.pin_threads = false;
+		}
+		else
+		{
+			instance.n_threads = n_threads;
+		}
+	}
+
+	LOG(INFO) << "Ensemble of " << instances.size() << " instances, "
+		<< (one_per_thread ? "one per thread" : "each on every thread") << " with " << n_threads << " threads";
+}
+
+std::vector<std::string> Ensemble::split_line(const std::string& line)
+{
+	std::vector<std::string> result;
+	std::istringstream stream(line);
+	std::string arg;
+	while (stream >> arg)
+	{
+		result.push_back(arg);
+	}
+	return result;
+}
+
+bool Ensemble::run()
+{
+	// The constructor logged why
+	if (instances.empty())
+	{
+		return false;
+	}
+
+	bool all_ran = true;
+	if (!one_per_thread)
+	{
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			all_ran = run_instance(i) && all_ran;
+		}
+		return all_ran;
+	}
+
+	// Instances take very different times, so they are handed out one at a time
+	#pragma omp parallel num_threads(n_threads)
+	{
+		if (pin_threads)
+		{
+			Numa::pin_thread(omp_get_thread_num(), omp_get_num_threads());
+		}
+
+		#pragma omp for schedule(dynamic, 1) reduction(&& : all_ran)
+		for (int i = 0; i < instances.size(); i++)
+		{
+			// A team of its own, so the worksharing of the simulation
+			// binds to it instead of the ensemble's team
+			bool ran = true;
+			#pragma omp parallel num_threads(1)
+			{
+				ran = run_instance(i);
+			}
+			all_ran = ran && all_ran;
+		}
+	}
+	return all_ran;
+}
+
+bool Ensemble::run_instance(size_t index)
+{
+	const Settings& settings = instances[index];
+	const double start = omp_get_wtime();
+
+	// Settings logged why
+	if (!settings.is_valid)
+	{
+		LOG(ERROR) << "Instance " << index << " (seed " << settings.seed << ") has invalid parameters";
+		return false;
+	}
+
+	// Built by the thread that runs it, so its memory is on that thread's node
+	Simulation simulation(settings);
+	if (!simulation.is_ready)
+	{
+		LOG(ERROR) << "Instance " << index << " (seed " << settings.seed << ") could not start";
+		return false;
+	}
+	simulation.run();
+
+	LOG(INFO) << "Instance " << index << " (seed " << settings.seed << "): "
+		<< simulation.n_living_agents << " living agents after " << settings.n_iterations << " iterations, "
+		<< (int)((omp_get_wtime() - start) * 1000.0) << "ms";
+	return true;
+}
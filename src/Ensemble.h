@@ -0,0 +1,46 @@
+#pragma once
+#include <easylogging/easylogging++.h>
+#include <string>
+#include <vector>
+#include "Settings.h"
+
+// Runs many independent simulations in one process, on one team of threads.
+// Each instance takes the flags given to the program followed by the ones on
+// its line of the ensemble file, so a line usually holds a seed and the
+// parameters being swept. Lines starting with '#' are skipped. Checkpoint
+// and restore files get the instance number appended, starting at 0.
+class Ensemble
+{
+public:
+
+	// Reads the instances from settings.ensemble. argc and argv are the program's
+	Ensemble(int argc, char* argv[], const Settings& settings);
+
+	// Run every instance and log how each one ended. Returns false if the
+	// ensemble file couldn't be read, has no instances, or an instance couldn't start
+	bool run();
+
+	// Agents a thread should get for an instance to be split between threads
+	static constexpr int min_agents_per_thread = 16384;
+
+private:
+
+	// Settings of each instance, already set to the layout
+	std::vector<Settings> instances;
+
+	// Threads shared by the instances
+	int n_threads;
+
+	// Pin the threads of the ensemble when they each run their own instances
+	bool pin_threads;
+
+	// Run each instance on a single thread, several at a time, instead of
+	// one after the other with every thread
+	bool one_per_thread;
+
+	// Flags of one line of the ensemble file
+	static std::vector<std::string> split_line(const std::string& line);
+
+	// Build, run and log instance 'index'. Returns false if it couldn't start
+	bool run_instance(size_t index);
+};
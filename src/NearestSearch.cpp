@@ -0,0 +1,159 @@
+#include "NearestSearch.h"
+#include <limits>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define NEAREST_SEARCH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NEAREST_SEARCH_AVX2
+#else
+#define NEAREST_SEARCH_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+const bool NearestSearch::use_avx2 = NearestSearch::has_avx2();
+
+Nearest NearestSearch::find(const float* x, const float* y, size_t count, vec2f position)
+{
+	if (use_avx2)
+	{
+		return find_avx2(x, y, count, position);
+	}
+	return find_scalar(x, y, count, position);
+}
+
+Nearest NearestSearch::find_scalar(const float* x, const float* y, size_t count, vec2f position)
+{
+	Nearest nearest = { no_slot, std::numeric_limits<float>::infinity() };
+	for (size_t i = 0; i < count; i++)
+	{
+		float dx = x[i] - position.x;
+		float dy = y[i] - position.y;
+		float squared_distance = dx * dx + dy * dy;
+		if (squared_distance < nearest.squared_distance)
+		{
+			nearest.slot = i;
+			nearest.squared_distance = squared_distance;
+		}
+	}
+	return nearest;
+}
+
+Nearest NearestSearch::find_lowest_id(const float* x, const float* y, const size_t* ids, size_t count, vec2f position)
+{
+	Nearest nearest = { no_slot, std::numeric_limits<float>::infinity() };
+	for (size_t i = 0; i < count; i++)
+	{
+		float dx = x[i] - position.x;
+		float dy = y[i] - position.y;
+		float squared_distance = dx * dx + dy * dy;
+		// Points infinitely far away are skipped like in find, so a tie needs a point found before
+		if (squared_distance < nearest.squared_distance ||
+			(squared_distance == nearest.squared_distance && nearest.slot != no_slot && ids[i] < ids[nearest.slot]))
+		{
+			nearest.slot = i;
+			nearest.squared_distance = squared_distance;
+		}
+	}
+	return nearest;
+}
+
+#ifdef NEAREST_SEARCH_X86
+
+NEAREST_SEARCH_AVX2 Nearest NearestSearch::find_avx2(const float* x, const float* y, size_t count, vec2f position)
+{
+	const __m256 position_x = _mm256_set1_ps(position.x);
+	const __m256 position_y = _mm256_set1_ps(position.y);
+	const __m256i lane_step = _mm256_set1_epi32(8);
+	__m256i lane_slots = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 best_distances = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+	__m256i best_slots = _mm256_set1_epi32(-1);
+
+	// Each lane keeps the first closest point it has seen
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), position_x);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), position_y);
+		__m256 squared_distances = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+		__m256 closer = _mm256_cmp_ps(squared_distances, best_distances, _CMP_LT_OQ);
+		best_distances = _mm256_blendv_ps(best_distances, squared_distances, closer);
+		best_slots = _mm256_blendv_epi8(best_slots, lane_slots, _mm256_castps_si256(closer));
+		lane_slots = _mm256_add_epi32(lane_slots, lane_step);
+	}
+
+	// Reduce the lanes, on ties the lowest slot wins like in the scalar search
+	alignas(32) float lane_distances[8];
+	alignas(32) int lane_best_slots[8];
+	_mm256_store_ps(lane_distances, best_distances);
+	_mm256_store_si256((__m256i*)lane_best_slots, best_slots);
+
+	Nearest nearest = { no_slot, std::numeric_limits<float>::infinity() };
+	for (int lane = 0; lane < 8; lane++)
+	{
+		if (lane_best_slots[lane] < 0)
+		{
+			continue;
+		}
+		size_t slot = (size_t)lane_best_slots[lane];
+		if (lane_distances[lane] < nearest.squared_distance ||
+			(lane_distances[lane] == nearest.squared_distance && slot < nearest.slot))
+		{
+			nearest.slot = slot;
+			nearest.squared_distance = lane_distances[lane];
+		}
+	}
+
+	// Remaining points, all after the ones above so only a strictly closer one wins
+	Nearest tail = find_scalar(x + i, y + i, count - i, position);
+	if (tail.squared_distance < nearest.squared_distance)
+	{
+		nearest.slot = tail.slot + i;
+		nearest.squared_distance = tail.squared_distance;
+	}
+	return nearest;
+}
+
+bool NearestSearch::has_avx2()
+{
+#if defined(_MSC_VER)
+	int registers[4];
+	__cpuid(registers, 0);
+	if (registers[0] < 7)
+	{
+		return false;
+	}
+	__cpuid(registers, 1);
+	bool has_osxsave = (registers[2] & (1 << 27)) != 0;
+	bool has_avx = (registers[2] & (1 << 28)) != 0;
+	if (!has_osxsave || !has_avx)
+	{
+		return false;
+	}
+	// The OS must save the YMM registers on context switches
+	if ((_xgetbv(0) & 0x6) != 0x6)
+	{
+		return false;
+	}
+	__cpuidex(registers, 7, 0);
+	return (registers[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#else
+
+Nearest NearestSearch::find_avx2(const float* x, const float* y, size_t count, vec2f position)
+{
+	return find_scalar(x, y, count, position);
+}
+
+bool NearestSearch::has_avx2()
+{
+	return false;
+}
+
+#endif
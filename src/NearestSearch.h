@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include "vec2f.h"
+
+// Closest point found by a search
+struct Nearest {
+	size_t slot;				// Position of the point in the searched arrays, or no_slot
+	float squared_distance;		// Squared distance to it, infinity if nothing was found
+};
+
+// Nearest point search over coordinates stored as separate x and y arrays.
+// Picks the AVX2 kernel when the CPU supports it and the scalar one otherwise.
+// Both return the lowest slot when several points are equally close.
+class NearestSearch
+{
+public:
+
+	static constexpr size_t no_slot = static_cast<size_t>(-1);
+
+	// Closest of the 'count' points in x/y to position
+	static Nearest find(const float* x, const float* y, size_t count, vec2f position);
+
+	static Nearest find_scalar(const float* x, const float* y, size_t count, vec2f position);
+
+	// Like find, but equally close points are told apart by their id instead of their slot,
+	// so the result doesn't depend on the order of the points
+	static Nearest find_lowest_id(const float* x, const float* y, const size_t* ids, size_t count, vec2f position);
+
+	static Nearest find_avx2(const float* x, const float* y, size_t count, vec2f position);
+
+	// Whether the CPU and OS support AVX2
+	static bool has_avx2();
+
+private:
+
+	// Kernel selected on first use
+	static const bool use_avx2;
+};
@@ -0,0 +1,222 @@
+#include "Numa.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Linux builds use libnuma when its header is installed. It is loaded at run time,
+// so the program still runs where the library is missing. NO_LIBNUMA turns it off
+#if !defined(_WIN32) && !defined(USE_LIBNUMA) && !defined(NO_LIBNUMA) && defined(__has_include)
+#if __has_include(<numa.h>) && __has_include(<dlfcn.h>)
+#define USE_LIBNUMA
+#endif
+#endif
+
+#ifdef USE_LIBNUMA
+#include <numa.h>
+#include <dlfcn.h>
+
+namespace
+{
+	// The libnuma functions used, null when the library couldn't be loaded
+	struct LibNuma
+	{
+		decltype(&numa_available) available = nullptr;
+		decltype(&numa_max_node) max_node = nullptr;
+		decltype(&numa_node_of_cpu) node_of_cpu = nullptr;
+
+		LibNuma()
+		{
+			void* library = dlopen("libnuma.so.1", RTLD_NOW | RTLD_LOCAL);
+			if (library == nullptr)
+			{
+				return;
+			}
+			available = (decltype(available))dlsym(library, "numa_available");
+			max_node = (decltype(max_node))dlsym(library, "numa_max_node");
+			node_of_cpu = (decltype(node_of_cpu))dlsym(library, "numa_node_of_cpu");
+			if (available == nullptr || max_node == nullptr || node_of_cpu == nullptr)
+			{
+				available = nullptr;
+			}
+		}
+	};
+
+	const LibNuma& libnuma()
+	{
+		static const LibNuma library;
+		return library;
+	}
+}
+#endif
+
+bool Numa::available()
+{
+#if defined(_WIN32)
+	ULONG highest_node;
+	return GetNumaHighestNodeNumber(&highest_node) != 0;
+#elif defined(USE_LIBNUMA)
+	static const bool is_available = libnuma().available != nullptr && libnuma().available() >= 0;
+	return is_available;
+#else
+	return false;
+#endif
+}
+
+int Numa::node_count()
+{
+	if (!available())
+	{
+		return 1;
+	}
+#if defined(_WIN32)
+	ULONG highest_node = 0;
+	GetNumaHighestNodeNumber(&highest_node);
+	return (int)highest_node + 1;
+#elif defined(USE_LIBNUMA)
+	return libnuma().max_node() + 1;
+#else
+	return 1;
+#endif
+}
+
+int Numa::node_of_cpu(int cpu)
+{
+#if defined(_WIN32)
+	for (int node = 0; node < node_count(); node++)
+	{
+		GROUP_AFFINITY affinity;
+		if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) &&
+			affinity.Group == 0 && (affinity.Mask & (KAFFINITY(1) << cpu)))
+		{
+			return node;
+		}
+	}
+#elif defined(USE_LIBNUMA)
+	const int node = libnuma().node_of_cpu(cpu);
+	if (node >= 0 && node < node_count())
+	{
+		return node;
+	}
+#endif
+	return 0;
+}
+
+const std::vector<int>& Numa::cpus()
+{
+	// Built by the first thread to pin itself, before it is pinned, so it is the affinity of the process
+	static const std::vector<int> usable_cpus = []()
+	{
+		std::vector<int> usable;
+#ifdef _WIN32
+		// Thread affinity masks only reach the first processor group
+		DWORD_PTR process_mask = 0;
+		DWORD_PTR system_mask = 0;
+		GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+		for (int cpu = 0; cpu < (int)(sizeof(DWORD_PTR) * 8); cpu++)
+		{
+			if (process_mask & (DWORD_PTR(1) << cpu))
+			{
+				usable.push_back(cpu);
+			}
+		}
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			{
+				if (CPU_ISSET(cpu, &set))
+				{
+					usable.push_back(cpu);
+				}
+			}
+		}
+#endif
+		if (usable.empty())
+		{
+			usable.push_back(0);
+		}
+
+		if (!available())
+		{
+			return usable;
+		}
+
+		// Grouped by node, in CPU order within a node
+		std::vector<int> nodes;
+		for (int cpu : usable)
+		{
+			nodes.push_back(node_of_cpu(cpu));
+		}
+		std::vector<int> grouped;
+		for (int node = 0; node < node_count(); node++)
+		{
+			for (size_t k = 0; k < usable.size(); k++)
+			{
+				if (nodes[k] == node)
+				{
+					grouped.push_back(usable[k]);
+				}
+			}
+		}
+		return grouped;
+	}();
+	return usable_cpus;
+}
+
+int Numa::cpu_of_thread(int thread, int n_threads)
+{
+	const std::vector<int>& usable = cpus();
+	// More threads than CPUs wrap around, each CPU then runs several of them
+	if (n_threads > (int)usable.size())
+	{
+		return usable[thread % usable.size()];
+	}
+	return usable[(size_t)thread * usable.size() / n_threads];
+}
+
+bool Numa::pin_thread(int thread, int n_threads)
+{
+	const int cpu = cpu_of_thread(thread, n_threads);
+#ifdef _WIN32
+	if (cpu >= 64)
+	{
+		return false;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+bool Numa::unpin_thread()
+{
+#ifdef _WIN32
+	DWORD_PTR process_mask;
+	DWORD_PTR system_mask;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+	{
+		return false;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), process_mask) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus())
+	{
+		CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+
+// Thread placement for machines with several memory nodes.
+// Uses the NUMA functions of the system on Windows, and libnuma on Linux when
+// built with USE_LIBNUMA, which Numa.cpp defines when <numa.h> is installed.
+// libnuma is loaded at run time, glibc before 2.34 needs -ldl for it. Without it,
+// or when the system has no NUMA support, every CPU is treated as part of a single node.
+class Numa
+{
+public:
+
+	// Whether NUMA support was built in and the system supports it
+	static bool available();
+
+	// Number of memory nodes, 1 without NUMA support
+	static int node_count();
+
+	// CPU thread 'thread' of 'n_threads' runs on. Threads are spread over the nodes
+	// in contiguous blocks, so threads working on neighbouring agents share a node
+	static int cpu_of_thread(int thread, int n_threads);
+
+	// Pin the calling thread to cpu_of_thread. Returns false if the system refused
+	static bool pin_thread(int thread, int n_threads);
+
+	// Let the calling thread run on any usable CPU again
+	static bool unpin_thread();
+
+private:
+
+	// CPUs of the process affinity mask, grouped by node
+	static const std::vector<int>& cpus();
+
+	// Node of CPU 'cpu', 0 when unknown
+	static int node_of_cpu(int cpu);
+};
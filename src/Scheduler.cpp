@@ -0,0 +1,94 @@
+#include "Scheduler.h"
+#include <algorithm>
+
+Scheduler::Scheduler(Schedule schedule, int n_threads, bool measure_balance) :
+	schedule(schedule),
+	n_threads(n_threads),
+	measure_balance(measure_balance),
+	queues(n_threads),
+	thread_times(n_threads)
+{
+	for (WorkQueue& queue : queues)
+	{
+		queue.blocks.store(pack(0, 0));
+	}
+}
+
+bool Scheduler::take_own(int thread, size_t& block)
+{
+	std::atomic<uint64_t>& blocks = queues[thread].blocks;
+	uint64_t range = blocks.load();
+	while (true)
+	{
+		uint64_t first = range & 0xFFFFFFFF;
+		uint64_t end = range >> 32;
+		if (first >= end)
+		{
+			return false;
+		}
+		if (blocks.compare_exchange_weak(range, pack(first + 1, end)))
+		{
+			block = first;
+			return true;
+		}
+	}
+}
+
+bool Scheduler::steal(int thread, int threads)
+{
+	// Start with the next thread, so thieves don't all go after the same one
+	for (int offset = 1; offset < threads; offset++)
+	{
+		std::atomic<uint64_t>& blocks = queues[(thread + offset) % threads].blocks;
+		uint64_t range = blocks.load();
+		while (true)
+		{
+			uint64_t first = range & 0xFFFFFFFF;
+			uint64_t end = range >> 32;
+			if (first >= end)
+			{
+				break;
+			}
+			uint64_t taken = (end - first + 1) / 2;
+			if (blocks.compare_exchange_weak(range, pack(first, end - taken)))
+			{
+				// The own range is empty, thieves never write to it
+				queues[thread].blocks.store(pack(end - taken, end));
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Scheduler::record(const char* phase, int threads, double bytes)
+{
+	double busiest = 0.0;
+	double total = 0.0;
+	for (int t = 0; t < threads; t++)
+	{
+		busiest = std::max(busiest, thread_times[t].busy);
+		total += thread_times[t].busy;
+	}
+
+	Balance& balance = balances[phase];
+	balance.busiest += busiest;
+	balance.average += total / threads;
+	balance.loops++;
+	balance.bytes += bytes;
+}
+
+void Scheduler::log_balance() const
+{
+	for (const auto& [phase, balance] : balances)
+	{
+		double imbalance = balance.average > 0.0 ? balance.busiest / balance.average : 1.0;
+		LOG(INFO) << "Load balance of " << phase << ": busiest thread " << imbalance << "x the average over "
+			<< balance.loops << " loops, " << balance.busiest * 1000.0 << "ms on the critical path";
+		if (balance.bytes > 0.0 && balance.busiest > 0.0)
+		{
+			LOG(INFO) << "Modelled traffic of " << phase << ": " << balance.bytes / 1e9 << " GB of agent arrays, "
+				<< balance.bytes / 1e9 / balance.busiest << " GB/s (counted per agent, not measured)";
+		}
+	}
+}
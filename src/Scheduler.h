@@ -0,0 +1,151 @@
+#pragma once
+#include <easylogging/easylogging++.h>
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// How a parallel loop hands out its iterations to the threads
+enum class Schedule {
+	Static,		// One contiguous range per thread
+	Dynamic,	// Blocks taken in order from a shared counter
+	Stealing	// One range of blocks per thread, idle threads steal half of a busy thread's blocks
+};
+
+// Runs the agent loops of a step with the selected schedule.
+// Hunters cost a neighborhood scan and incubators a single add, so
+// static ranges leave threads idle when hunters bunch up in some of them.
+// Optionally measures how long each thread worked on every loop.
+class Scheduler
+{
+public:
+
+	Scheduler(Schedule schedule, int n_threads, bool measure_balance);
+
+	// Call body(k) for every k in [0, count). Dynamic and stealing schedules
+	// hand out 'block_size' iterations at a time. 'phase' names the loop in the balance log,
+	// which also reports the loop's modelled traffic when 'bytes_per_iteration' isn't 0.
+	// Called by every thread of the team. Threads return as soon as there's nothing left
+	// for them, so the team has to synchronize before the next loop
+	template<typename Body>
+	void for_each(const char* phase, size_t count, size_t block_size, size_t bytes_per_iteration, Body&& body);
+
+	// Log, for each phase, the busiest thread's time over the average thread time,
+	// and the modelled bytes it moved over its time on the critical path
+	void log_balance() const;
+
+	// Iterations handed out at a time when a loop has no reason to pick another size
+	static constexpr size_t default_block_size = 256;
+
+	Schedule schedule;
+
+	int n_threads;
+
+	bool measure_balance;
+
+private:
+
+	// Take the first block of the thread's own range. Returns false when it's empty
+	bool take_own(int thread, size_t& block);
+
+	// Move half of the blocks left in another thread's range to this thread's range.
+	// Returns false when no thread had blocks left
+	bool steal(int thread, int threads);
+
+	// Add the thread times and bytes of the last loop to the balance of 'phase'
+	void record(const char* phase, int threads, double bytes);
+
+	// Blocks [first, end) of a thread packed in one word, first in the low half,
+	// so the owner and thieves take blocks with a single compare and swap
+	static inline uint64_t pack(uint64_t first, uint64_t end)
+	{
+		return first | (end << 32);
+	}
+
+	struct alignas(64) WorkQueue {
+		std::atomic<uint64_t> blocks;
+	};
+
+	std::vector<WorkQueue> queues;
+
+	// Time each thread spent on the last loop, padded so threads don't share a line
+	struct alignas(64) ThreadTime {
+		double busy = 0.0;
+	};
+
+	std::vector<ThreadTime> thread_times;
+
+	// Summed thread times of every loop of a phase
+	struct Balance {
+		double busiest = 0.0;
+		double average = 0.0;
+		size_t loops = 0;
+		double bytes = 0.0;
+	};
+
+	std::map<std::string, Balance> balances;
+};
+
+template<typename Body>
+void Scheduler::for_each(const char* phase, size_t count, size_t block_size, size_t bytes_per_iteration, Body&& body)
+{
+	const int n = (int)count;
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const double start = measure_balance ? omp_get_wtime() : 0.0;
+
+	switch (schedule)
+	{
+	case Schedule::Static:
+		#pragma omp for schedule(static) nowait
+		for (int k = 0; k < n; k++)
+		{
+			body(k);
+		}
+		break;
+
+	case Schedule::Dynamic:
+		#pragma omp for schedule(dynamic, block_size) nowait
+		for (int k = 0; k < n; k++)
+		{
+			body(k);
+		}
+		break;
+
+	case Schedule::Stealing:
+	{
+		const size_t n_blocks = (count + block_size - 1) / block_size;
+		queues[thread].blocks.store(pack(n_blocks * thread / threads, n_blocks * (thread + 1) / threads));
+
+		// Nobody steals before every range is set
+		#pragma omp barrier
+
+		size_t block;
+		do
+		{
+			while (take_own(thread, block))
+			{
+				const size_t end = std::min(count, (block + 1) * block_size);
+				for (size_t k = block * block_size; k < end; k++)
+				{
+					body(k);
+				}
+			}
+		} while (steal(thread, threads));
+		break;
+	}
+	}
+
+	if (measure_balance)
+	{
+		thread_times[thread].busy = omp_get_wtime() - start;
+		#pragma omp barrier
+		#pragma omp single
+		{
+			record(phase, threads, (double)count * bytes_per_iteration);
+		}
+	}
+}
@@ -1,4 +1,5 @@
 #include "Settings.h"
+#include <easylogging/easylogging++.h>
 
 Settings::Settings(int argc, char * argv[])
 {
@@ -10,6 +11,30 @@ Settings::Settings(int argc, char * argv[])
 	args::ValueFlag<int> threads(optional, "threads", "Maximum number of threads to run", { 't', "threads" }, 1);
 	args::ValueFlag<int> iterations(optional, "iterations", "Number of iterations to simulate", { 'i', "iterations" }, 10000);
 	args::Flag headless(optional, "headless", "Should run the simulation without the visualization", { 'h', "headless" });
+	args::MapFlag<std::string, IndexLocking> index_locking(optional, "index-locking", "Spatial index locking: global or chunk", { "index-locking" },
+		{ { "global", IndexLocking::Global }, { "chunk", IndexLocking::PerChunk } }, IndexLocking::PerChunk);
+	args::ValueFlag<int> grid_divisions(optional, "grid-divisions", "Spatial index chunks per dimension, 0 picks it from the agent density", { "grid-divisions" }, 0);
+	args::MapFlag<std::string, IndexBackend> index_backend(optional, "index", "Spatial index backend: incremental or rebuild", { "index" },
+		{ { "incremental", IndexBackend::Incremental }, { "rebuild", IndexBackend::Rebuild } }, IndexBackend::Incremental);
+	args::ValueFlag<int> compact_every(optional, "compact-every", "Pack living agents to the front every N steps, 0 disables it", { "compact-every" }, 1024);
+	args::ValueFlag<float> compact_threshold(optional, "compact-threshold", "Pack living agents to the front when this fraction of the used slots is dead", { "compact-threshold" }, 0.5f);
+	args::Flag fused(optional, "fused", "Update states and positions in a single pass over the agents", { "fused" });
+	args::Flag deterministic(optional, "deterministic", "Same results for the same seed whatever the number of threads", { "deterministic" });
+	args::MapFlag<std::string, Schedule> schedule(optional, "schedule", "How agent loops are split between threads: static, dynamic or stealing", { "schedule" },
+		{ { "static", Schedule::Static }, { "dynamic", Schedule::Dynamic }, { "stealing", Schedule::Stealing } }, Schedule::Static);
+	args::Flag numa(optional, "numa", "Let each thread first touch the agent memory it works on, implies --pin-threads", { "numa" });
+	args::Flag pin_threads(optional, "pin-threads", "Pin each thread to its own CPU, spread over the NUMA nodes", { "pin-threads" });
+	args::ValueFlag<float> map_size(optional, "map-size", "Half the side of the map", { "map-size" }, default_params.map_size);
+	args::ValueFlag<float> incubating_mass(optional, "incubating-mass", "Mass under which a hunter goes back to incubating", { "incubating-mass" }, default_params.incubating_mass);
+	args::ValueFlag<float> hunting_mass(optional, "hunting-mass", "Mass an incubator starts hunting at", { "hunting-mass" }, default_params.hunting_mass);
+	args::ValueFlag<float> splitting_mass(optional, "splitting-mass", "Mass a hunter splits in two at", { "splitting-mass" }, default_params.splitting_mass);
+	args::ValueFlag<float> move_mass_cost(optional, "move-cost", "Mass a hunter spends on each step it moves", { "move-cost" }, default_params.move_mass_cost);
+	args::ValueFlag<float> incubate_mass_reward(optional, "incubate-reward", "Mass an incubator gains on each step", { "incubate-reward" }, default_params.incubate_mass_reward);
+	args::ValueFlag<float> max_eat_distance(optional, "eat-distance", "Maximum distance at which a hunter eats its prey", { "eat-distance" }, default_params.max_eat_distance);
+	args::ValueFlag<std::string> ensemble(optional, "file", "Run one headless simulation per line of the file in this process, each line holds the flags of its instance", { "ensemble" });
+	args::ValueFlag<int> checkpoint_every(optional, "checkpoint-every", "Save the simulation every N steps, 0 disables it", { "checkpoint-every" }, 0);
+	args::ValueFlag<std::string> checkpoint_file(optional, "file", "File checkpoints are saved to", { "checkpoint-file" }, "checkpoint.bin");
+	args::ValueFlag<std::string> restore(optional, "file", "Carry on from a checkpoint instead of starting from the seed", { "restore" });
 	args::Flag debug(optional, "debug", "Show debug information", { "debug" });
 	parser.ParseCLI(argc, argv);
 
@@ -20,4 +45,35 @@ Settings::Settings(int argc, char * argv[])
 	this->n_iterations = iterations.Get();
 	this->n_start_agents = start_agents_number.Get();
 	this->n_maximum_agents = maximum_agents_number.Get();
+	this->index_locking = index_locking.Get();
+	this->grid_divisions = grid_divisions.Get();
+	this->index_backend = index_backend.Get();
+	this->compact_every = compact_every.Get();
+	this->compact_threshold = compact_threshold.Get();
+	this->fused_step = fused.Get();
+	this->deterministic = deterministic.Get();
+	this->schedule = schedule.Get();
+	this->numa = numa.Get();
+	this->pin_threads = pin_threads.Get() || numa.Get();
+	this->params.map_size = map_size.Get();
+	this->params.incubating_mass = incubating_mass.Get();
+	this->params.hunting_mass = hunting_mass.Get();
+	this->params.splitting_mass = splitting_mass.Get();
+	this->params.move_mass_cost = move_mass_cost.Get();
+	this->params.incubate_mass_reward = incubate_mass_reward.Get();
+	this->params.max_eat_distance = max_eat_distance.Get();
+	std::string invalid = this->params.invalid_reason();
+	if (invalid.empty() && this->grid_divisions < 0)
+	{
+		invalid = "--grid-divisions can't be negative, 0 picks it from the agent density";
+	}
+	this->is_valid = invalid.empty();
+	if (!is_valid)
+	{
+		LOG(ERROR) << "Invalid parameters: " << invalid;
+	}
+	this->ensemble = ensemble.Get();
+	this->checkpoint_every = checkpoint_every.Get();
+	this->checkpoint_file = checkpoint_file.Get();
+	this->restore = restore.Get();
 }
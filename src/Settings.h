@@ -1,5 +1,15 @@
 #pragma once
+#include <string>
 #include "ThirdParty/args/args.hxx"
+#include "SpatialIndex.h"
+#include "Scheduler.h"
+#include "SimulationParams.h"
+
+// How the simulation keeps its spatial index up to date
+enum class IndexBackend {
+	Incremental,	// SpatialIndex, updated as agents move, split and die
+	Rebuild			// CellList, rebuilt from scratch every step
+};
 
 class Settings
 {
@@ -13,4 +23,20 @@ public:
 	int n_iterations;
 	int n_start_agents;
 	int n_maximum_agents;
+	IndexLocking index_locking;
+	int grid_divisions;
+	IndexBackend index_backend;
+	int compact_every;
+	float compact_threshold;
+	bool fused_step;
+	bool deterministic;
+	Schedule schedule;
+	bool numa;
+	bool pin_threads;
+	SimulationParams params;
+	bool is_valid;			// False, after logging why, when these settings can't be simulated
+	std::string ensemble;
+	int checkpoint_every;
+	std::string checkpoint_file;
+	std::string restore;
 };
@@ -1,18 +1,36 @@
 #include "Simulation.h"
+#include "Numa.h"
+#include <omp.h>
+#include <cstring>
 
 Simulation::Simulation(Settings settings) :
-	states(std::vector<std::atomic<State>>(settings.n_maximum_agents)),
-	n_iterations(settings.n_iterations),
-	has_visualization(!settings.is_headless),
+	hunting_agents(settings.n_maximum_agents),
 	n_threads(settings.n_threads),
-	spatial_index(map_size)
+	n_iterations(settings.n_iterations),
+	compact_every(settings.compact_every),
+	compact_threshold(settings.compact_threshold),
+	fused_step(settings.fused_step),
+	pin_threads(settings.pin_threads),
+	deterministic(settings.deterministic),
+	checkpoint_every(settings.checkpoint_every),
+	checkpoint_file(settings.checkpoint_file),
+	params(settings.params),
+	index_backend(settings.index_backend),
+	spatial_index(params.map_size, grid_divisions(settings), settings.n_maximum_agents, settings.index_locking),
+	cell_list(params.map_size, spatial_index.divisions_per_dimension, settings.n_maximum_agents),
+	slot_allocator(settings.n_maximum_agents, settings.n_start_agents, settings.n_threads, settings.deterministic),
+	prey_added(spatial_index.divisions_per_dimension * spatial_index.divisions_per_dimension),
+	scheduler(settings.schedule, settings.n_threads, settings.debug),
+	has_visualization(!settings.is_headless)
 {
+	LOG(INFO) << "Spatial index grid: " << spatial_index.divisions_per_dimension << "x" << spatial_index.divisions_per_dimension;
+
 	std::default_random_engine generator;
 	generator.seed(settings.seed);
 
 	std::uniform_real_distribution<float> map_distribution(
-		-map_size + splitting_mass,
-		map_size - splitting_mass
+		-params.map_size + params.splitting_mass,
+		params.map_size - params.splitting_mass
 	);
 
 	std::uniform_real_distribution<float> mass_distribution(
@@ -20,264 +38,1385 @@ Simulation::Simulation(Settings settings) :
 		1.0f
 	);
 
-	movements.reserve(settings.n_maximum_agents);
-	positions.reserve(settings.n_maximum_agents);
-	masses.reserve(settings.n_maximum_agents);
-	eaten.reserve(settings.n_maximum_agents);
+	if (settings.numa)
+	{
+		LOG(INFO) << "NUMA nodes: " << Numa::node_count() << (Numa::available() ? "" : ", no NUMA support");
+	}
+
+	// Padded to whole cache lines of every agent array, so partition_bound parts never share a line
+	const size_t padded_capacity = (settings.n_maximum_agents + agents_per_line - 1) / agents_per_line * agents_per_line;
+	wakeup_wheels.resize(n_threads);
+	for (WakeupWheel& wheel : wakeup_wheels)
+	{
+		wheel.slots.resize(wheel_size);
+	}
+	// A restored run is placed as if it had the starting agents, its agent count is only known once restored
+	initialize_agent_arrays(padded_capacity, settings.n_start_agents, settings.numa ? n_threads : 1);
+
+	state_changes.resize(n_threads);
+	deferred_moves.resize(n_threads);
+	spawn_buffers.resize(n_threads);
+	eaters.resize(n_threads);
+	thread_hunters.resize(n_threads + 1);
+	due_incubators.resize((size_t)n_threads * n_threads);
+	thread_woken.resize(n_threads);
+	woken_offsets.resize(n_threads + 1);
 
-	for (size_t i = 0; i < settings.n_start_agents; i++)
+	// Start from the checkpoint when restoring one, from the seed otherwise.
+	// A run that can't restore isn't ready, starting over would save over the checkpoint
+	if (!settings.restore.empty())
 	{
-		vec2f position(map_distribution(generator), map_distribution(generator));
-		positions.push_back(position);
-		spatial_index.set(i, position);
+		if (!restore_checkpoint(settings.restore))
+		{
+			LOG(ERROR) << "Could not restore " << settings.restore;
+			is_ready = false;
+			return;
+		}
+		LOG(INFO) << "Restored step " << step_count << " from " << settings.restore;
+	}
+	else
+	{
+		for (size_t i = 0; i < settings.n_start_agents; i++)
+		{
+			vec2f position(map_distribution(generator), map_distribution(generator));
+			pos_x[i] = position.x;
+			pos_y[i] = position.y;
+			if (index_backend == IndexBackend::Incremental)
+			{
+				spatial_index.set(i, position, State::Incubating);
+			}
+
+			set_movement(i, vec2f(0.1f, 0.1f));
+			masses[i] = mass_distribution(generator);
+			set_state(i, State::Incubating);
+			incubation_start[i] = 0;
+			schedule_wakeup(i, 0, params);
+		}
 
-		movements.push_back(vec2f(0.1f, 0.1f));
-		masses.push_back(mass_distribution(generator));
-		eaten.push_back(std::numeric_limits<size_t>::max());
-		states[i].store(State::Incubating);
+		last_agent_index = settings.n_start_agents;
+		n_living_agents = settings.n_start_agents;
 	}
 
-	last_agent_index = settings.n_start_agents;
+	rebuild_active_lists();
+}
+
+void Simulation::initialize_agent_arrays(size_t capacity, size_t live_count, int threads)
+{
+	mov_x.resize(capacity);
+	mov_y.resize(capacity);
+	pos_x.resize(capacity);
+	pos_y.resize(capacity);
+	masses.resize(capacity);
+	eaten.resize(capacity);
+	incubation_start.resize(capacity);
+	wakeup_pass.resize(capacity);
+	scanned_on.resize(capacity);
+	targets.resize(capacity);
+	scanned_cells.resize(capacity);
+	// Only allocated here, the threads below construct them
+	states.allocate(capacity);
+	claims.allocate(capacity);
 
-	for (size_t i = settings.n_start_agents; i < settings.n_maximum_agents; i++)
+	// Memory is placed on the node of the thread that first writes it. Each thread clears
+	// the part of the living agents partition_bound gives it, which is the part it copies in
+	// compactions and checkpoints. The agent loops go over the active lists instead, which
+	// follow agent order, so the static schedule gives a thread about the same agents while
+	// hunters are spread evenly. The dynamic and stealing schedules don't. The spare slots,
+	// filled by agents spawned later, are split evenly as nothing tells who will use them
+	const size_t live_end = std::min(capacity, (live_count + agents_per_line - 1) / agents_per_line * agents_per_line);
+	#pragma omp parallel num_threads(threads)
 	{
-		movements.push_back(vec2f(0.0f, 0.0f));
-		positions.push_back(vec2f(0.0f, 0.0f));
-		masses.push_back(0.0f);
-		eaten.push_back(std::numeric_limits<size_t>::max());
-		states[i].store(State::Dead);
+		const int thread = omp_get_thread_num();
+		const int team = omp_get_num_threads();
+		if (pin_threads && team > 1)
+		{
+			Numa::pin_thread(thread, team);
+		}
+
+		auto clear = [&](size_t begin, size_t end)
+		{
+			std::fill(mov_x.begin() + begin, mov_x.begin() + end, 0.0f);
+			std::fill(mov_y.begin() + begin, mov_y.begin() + end, 0.0f);
+			std::fill(pos_x.begin() + begin, pos_x.begin() + end, 0.0f);
+			std::fill(pos_y.begin() + begin, pos_y.begin() + end, 0.0f);
+			std::fill(masses.begin() + begin, masses.begin() + end, 0.0f);
+			std::fill(eaten.begin() + begin, eaten.begin() + end, no_agent);
+			std::fill(incubation_start.begin() + begin, incubation_start.begin() + end, 0);
+			std::fill(wakeup_pass.begin() + begin, wakeup_pass.begin() + end, no_pass);
+			std::fill(scanned_on.begin() + begin, scanned_on.begin() + end, no_pass);
+			std::fill(targets.begin() + begin, targets.begin() + end, no_agent);
+			std::fill(scanned_cells.begin() + begin, scanned_cells.begin() + end, NearCells{ 0, 0, 0, 0 });
+			states.construct(begin, end, State::Dead);
+			claims.construct(begin, end, no_agent);
+			hunting_agents.clear_words(begin / AgentBits::bits_per_word, (end + AgentBits::bits_per_word - 1) / AgentBits::bits_per_word);
+			spatial_index.clear_agents(begin, end);
+		};
+		clear(partition_bound(live_end, thread, team), partition_bound(live_end, thread + 1, team));
+		clear(live_end + partition_bound(capacity - live_end, thread, team), live_end + partition_bound(capacity - live_end, thread + 1, team));
+	}
+
+	// The constructing thread was part of the team, it shouldn't stay pinned
+	if (pin_threads && threads > 1)
+	{
+		Numa::unpin_thread();
+	}
+}
+
+size_t Simulation::partition_bound(size_t count, int part, int parts)
+{
+	if (part >= parts)
+	{
+		return count;
+	}
+	return std::min(count, count * part / parts / agents_per_line * agents_per_line);
+}
+
+int Simulation::grid_divisions(const Settings& settings)
+{
+	if (settings.grid_divisions > 0)
+	{
+		return settings.grid_divisions;
 	}
+	return SpatialIndex::auto_divisions(settings.params.map_size, settings.params.max_eat_distance, settings.n_start_agents);
 }
 
 void Simulation::run()
 {
-	// Only lock/unlock mutex every few simulation steps reduce the lock overhead
-	for (int i = 0; i < n_iterations / 128; i++)
+	if (!is_ready)
+	{
+		return;
+	}
+
+	// A restored run carries on from the step it was saved at
+	const size_t first_step = step_count;
+	const size_t last_step = (size_t)(n_iterations / 128) * 128;
+
+	// The team of threads lives for the whole run, steps only meet at barriers
+	#pragma omp parallel num_threads(n_threads)
 	{
-		for (int j = 0; j < 128; j++)
+		if (pin_threads)
+		{
+			Numa::pin_thread(omp_get_thread_num(), omp_get_num_threads());
+		}
+
+		#pragma omp single
+		{
+			barrier.reset(omp_get_num_threads());
+		}
+
+		for (size_t i = first_step; i < last_step; i++)
 		{
-			step(0.05f);
+			step(step_delta);
+
+			if (checkpoint_every > 0 && (i + 1) % checkpoint_every == 0)
+			{
+				save_checkpoint();
+			}
 		}
 	}
+	checkpoint.wait();
+	if (scheduler.measure_balance)
+	{
+		scheduler.log_balance();
+	}
 	is_done = true;
 }
 
+void Simulation::sync()
+{
+	if (omp_in_parallel())
+	{
+		barrier.wait();
+	}
+}
+
+template<typename Visitor>
+void Simulation::for_each_saved_array(Visitor&& visit)
+{
+	visit(pos_x);
+	visit(pos_y);
+	visit(mov_x);
+	visit(mov_y);
+	visit(masses);
+	visit(eaten);
+	visit(incubation_start);
+	visit(wakeup_pass);
+	visit(scanned_on);
+	visit(targets);
+	visit(scanned_cells);
+}
+
+void Simulation::save_checkpoint()
+{
+	// Stable between steps, every thread reads the same
+	const size_t agent_count = last_agent_index;
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const size_t begin = partition_bound(agent_count, thread, threads);
+	const size_t end = partition_bound(agent_count, thread + 1, threads);
+	Snapshot& snapshot = checkpoint.snapshot();
+
+	// 1: Wait for the last checkpoint to be written and size the blocks.
+	// The agent arrays come first, then the states and the cells
+	#pragma omp single nowait
+	{
+		checkpoint.wait();
+
+		CheckpointHeader& header = snapshot.header;
+		std::memcpy(header.magic, Checkpoint::magic, sizeof(header.magic));
+		header.version = Checkpoint::version;
+		header.capacity = states.size();
+		header.agent_count = agent_count;
+		header.living_agents = n_living_agents;
+		header.step_count = step_count;
+		header.state_passes = state_passes;
+		header.grid_cells = prey_added.size();
+		header.params = params;
+		header.reserved = 0;
+
+		size_t block = 0;
+		snapshot.blocks.resize(saved_array_count + 2);
+		for_each_saved_array([&](auto& array)
+		{
+			snapshot.blocks[block++].resize(agent_count * sizeof(array[0]));
+		});
+		snapshot.blocks[block++].resize(agent_count * sizeof(State));
+		snapshot.blocks[block++].resize(prey_added.size() * sizeof(size_t));
+		header.block_count = (uint32_t)snapshot.blocks.size();
+	}
+	sync();
+
+	// 2: Each thread copies its agents
+	size_t block = 0;
+	for_each_saved_array([&](auto& array)
+	{
+		std::memcpy(snapshot.blocks[block++].data() + begin * sizeof(array[0]), array.data() + begin, (end - begin) * sizeof(array[0]));
+	});
+	State* saved_states = reinterpret_cast<State*>(snapshot.blocks[block++].data());
+	for (size_t i = begin; i < end; i++)
+	{
+		saved_states[i] = states[i].load();
+	}
+
+	#pragma omp single nowait
+	{
+		size_t* saved_cells = reinterpret_cast<size_t*>(snapshot.blocks[block].data());
+		for (size_t cell = 0; cell < prey_added.size(); cell++)
+		{
+			saved_cells[cell] = prey_added[cell].load(std::memory_order_relaxed);
+		}
+	}
+	sync();
+
+	// 3: The next steps don't touch the snapshot
+	#pragma omp single nowait
+	{
+		checkpoint.write_in_background(checkpoint_file);
+	}
+}
+
+bool Simulation::restore_checkpoint(const std::string& path)
+{
+	// Only a simulation of the same size and parameters can carry on from it.
+	// Its blocks are then the ones save_checkpoint writes for its agent count
+	auto block_sizes = [&](const CheckpointHeader& header)
+	{
+		std::vector<uint64_t> sizes;
+		if (header.capacity != states.size() || header.grid_cells != prey_added.size())
+		{
+			LOG(ERROR) << "Checkpoint " << path << " was saved with room for " << header.capacity << " agents on "
+				<< header.grid_cells << " cells, not " << states.size() << " agents on " << prey_added.size() << " cells";
+			return sizes;
+		}
+		if (header.agent_count > header.capacity || header.living_agents > header.agent_count)
+		{
+			LOG(ERROR) << "Checkpoint " << path << " has " << header.living_agents << " living agents out of "
+				<< header.agent_count << " with room for " << header.capacity;
+			return sizes;
+		}
+		if (header.params != params)
+		{
+			LOG(ERROR) << "Checkpoint " << path << " was saved with other simulation parameters";
+			return sizes;
+		}
+		for_each_saved_array([&](auto& array)
+		{
+			sizes.push_back(header.agent_count * sizeof(array[0]));
+		});
+		sizes.push_back(header.agent_count * sizeof(State));
+		sizes.push_back(prey_added.size() * sizeof(size_t));
+		return sizes;
+	};
+
+	Snapshot snapshot;
+	if (!Checkpoint::read(path, snapshot, block_sizes))
+	{
+		return false;
+	}
+	const CheckpointHeader& header = snapshot.header;
+	const size_t agent_count = header.agent_count;
+
+	last_agent_index = agent_count;
+	n_living_agents = header.living_agents;
+	step_count = header.step_count;
+	state_passes = header.state_passes;
+
+	size_t block = 0;
+	for_each_saved_array([&](auto& array)
+	{
+		std::memcpy(array.data(), snapshot.blocks[block++].data(), agent_count * sizeof(array[0]));
+	});
+	const State* saved_states = reinterpret_cast<const State*>(snapshot.blocks[block++].data());
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		states[i].store(i < agent_count ? saved_states[i] : State::Dead);
+	}
+	const size_t* saved_cells = reinterpret_cast<const size_t*>(snapshot.blocks[block++].data());
+	for (size_t cell = 0; cell < prey_added.size(); cell++)
+	{
+		prey_added[cell].store(saved_cells[cell]);
+	}
+	rebuild_state_bits(agent_count);
+
+	// Everything else follows from the arrays: the free slots, the wakeups, the
+	// hunters that still have to eat and the spatial index, which is rebuilt
+	// instead of saved since agents may be ordered differently in its chunks
+	slot_allocator.reset(agent_count);
+	for (size_t i = 0; i < agent_count; i++)
+	{
+		const State state = states[i].load();
+		if (state == State::Dead)
+		{
+			slot_allocator.release(i, 0);
+			continue;
+		}
+		if (state == State::Incubating && wakeup_pass[i] != no_pass)
+		{
+			wakeup_wheels[0].slots[wakeup_pass[i] % wheel_size].push_back(i);
+		}
+		if (eaten[i] != no_agent)
+		{
+			eaters[0].hunters.push_back(i);
+		}
+		if (index_backend == IndexBackend::Incremental)
+		{
+			spatial_index.set(i, position_of(i), state);
+		}
+	}
+	return true;
+}
+
 void Simulation::step(float delta)
 {
-	// 0: Update eaten agents on last step
-	update_eaten_agents(delta);
+	if (fused_step)
+	{
+		if (index_backend == IndexBackend::Rebuild)
+		{
+			cell_list.rebuild(pos_x, pos_y, states, last_agent_index);
+		}
+
+		// 1 and 2: Update state and position of each agent in a single pass
+		update_agents_fused(delta);
+
+		// 0: Update agents eaten on this step, same as doing it at the start of the next one
+		update_eaten_agents(delta);
+	}
+	else
+	{
+		// 0: Update eaten agents on last step
+		update_eaten_agents(delta);
+
+		if (index_backend == IndexBackend::Rebuild)
+		{
+			cell_list.rebuild(pos_x, pos_y, states, last_agent_index);
+		}
+
+		// 1: Update state based on current status
+		update_states(delta);
+
+		// 2: Update position based on movement and update spatial index
+		update_positions(delta);
+	}
+
+	// 3: Add the agents split on this step
+	spawn_agents();
+
+	// 4: Stop iterating over dead agents. Every thread decides before the counters change
+	bool compaction_due = compact_every > 0 && (step_count + 1) % compact_every == 0;
+	bool too_many_dead = last_agent_index > 0 &&
+		(float)(last_agent_index - n_living_agents) / last_agent_index > compact_threshold;
+	sync();
+
+	#pragma omp single nowait
+	{
+		step_count++;
+	}
+	if (compaction_due || too_many_dead)
+	{
+		compact_agents();
+	}
 
-	// 1: Update state based on current status
-	update_states(delta);
+	// 5: Find the agents the next step has to visit
+	rebuild_active_lists();
+}
 
-	// 2: Update position based on movement and update spatial index
-	update_positions(delta);
+template<typename Body>
+void Simulation::with_params(Body&& body)
+{
+	// Add a set here to compile the kernels for it
+	if (params == default_params)
+	{
+		body(FixedParams<default_params>());
+		return;
+	}
+	body(params);
 }
 
 void Simulation::update_eaten_agents(float delta)
 {
-	#pragma omp parallel for num_threads(n_threads)
-	for (int i = 0; i < last_agent_index; i++)
+	// 1: Hunters that tried to eat claim their prey, the lowest hunter index wins
+	#pragma omp for nowait
+	for (int t = 0; t < eaters.size(); t++)
+	{
+		for (size_t i : eaters[t].hunters)
+		{
+			claim(i, eaten[i]);
+		}
+	}
+	sync();
+
+	// 2: Only the winners eat
+	#pragma omp for nowait
+	for (int t = 0; t < eaters.size(); t++)
 	{
-		size_t eaten_index = eaten[i];
-		if (eaten_index != no_agent)
+		for (size_t i : eaters[t].hunters)
 		{
-			State incubating = State::Incubating;
-			// Two agents could try to eat the same incubating agent at once. Only one will get it
-			if (states[eaten_index].compare_exchange_strong(incubating, State::Dead))
+			if (eat(i, eaten[i]))
 			{
-				masses[i] += masses[eaten_index];
-				spatial_index.remove(eaten_index, positions[eaten_index]);
+				eaters[t].eaten.push_back(eaten[i]);
 			}
 			eaten[i] = no_agent;
 		}
+		eaters[t].hunters.clear();
+	}
+	sync();
+
+	#pragma omp single nowait
+	{
+		removed_agents.clear();
+		for (EaterBuffer& buffer : eaters)
+		{
+			removed_agents.insert(removed_agents.end(), buffer.eaten.begin(), buffer.eaten.end());
+			buffer.eaten.clear();
+		}
+		n_living_agents -= removed_agents.size();
+	}
+	sync();
+
+	// 3: Remove the eaten agents from the index, a whole chunk at a time
+	if (index_backend == IndexBackend::Incremental)
+	{
+		spatial_index.remove_all(removed_agents);
+	}
+}
+
+inline void Simulation::claim(size_t index, size_t eaten_index)
+{
+	std::atomic<size_t>& claim = claims[eaten_index];
+	size_t current = claim.load(std::memory_order_relaxed);
+	while (index < current && !claim.compare_exchange_weak(current, index, std::memory_order_relaxed))
+	{
+	}
+}
+
+inline bool Simulation::eat(size_t index, size_t eaten_index)
+{
+	std::atomic<size_t>& claim = claims[eaten_index];
+	if (claim.load(std::memory_order_relaxed) != index)
+	{
+		return false;
+	}
+	// Losers compare against their own index, so they can't mistake the reset for a win
+	claim.store(no_agent, std::memory_order_relaxed);
+
+	// Only the winner touches the prey, but it may have started hunting since it was targeted
+	if (states[eaten_index].load() != State::Incubating)
+	{
+		return false;
 	}
+	masses[index] += mass_of(eaten_index);
+	set_state(eaten_index, State::Dead);
+	slot_allocator.release(eaten_index, omp_get_thread_num());
+	return true;
 }
 
 void Simulation::update_states(float delta)
 {
-	#pragma omp parallel for num_threads(n_threads)
-	for (int i = 0; i < last_agent_index; i++)
+	collect_woken_incubators();
+
+	// Only hunters and the incubators that reach hunting_mass on this pass are visited
+	const size_t n_active = woken.size() + active_hunters.size();
+	with_params([&](const auto& p)
 	{
-		float& mass = masses[i];
-		std::atomic<State>& state = states[i];
-		vec2f& position = positions[i];
-		vec2f& movement = movements[i];
+		scheduler.for_each("states", n_active, Scheduler::default_block_size, state_pass_bytes, [&](size_t k)
+		{
+			update_state(active_agent(k), p);
+		});
+	});
+	sync();
+
+	apply_state_changes();
+
+	// Read by the next phases after they sync
+	#pragma omp single nowait
+	{
+		state_passes++;
+	}
+}
 
-		// Update state and take action
-		switch (state.load())
+void Simulation::update_agents_fused(float delta)
+{
+	// Tiles are sized so an agent's data is still in cache when it moves.
+	// Hunters read both partitions of the index, so neither changes during
+	// the pass: moves are applied after it, together with the state changes
+	collect_woken_incubators();
+	const size_t n_active = woken.size() + active_hunters.size();
+	with_params([&](const auto& p)
+	{
+		scheduler.for_each("fused", n_active, tile_size, fused_pass_bytes, [&](size_t k)
 		{
-		case State::Incubating:
-			if (mass >= hunting_mass)
-			{
-				state.store(State::Hunting);
-				simulate_hunting(i);
-			}
-			else
+			size_t i = active_agent(k);
+			bool changed_state = update_state(i, p);
+			if (states[i].load() == State::Hunting)
 			{
-				simulate_incubating(i);
+				// Agents that started hunting are moved in the index by their state change
+				const vec2f old_position = position_of(i);
+				move_agent(i, delta, false, p);
+				if (!changed_state && index_backend == IndexBackend::Incremental)
+				{
+					deferred_moves[omp_get_thread_num()].push_back({ i, old_position });
+				}
 			}
-			break;
+		});
+	});
+	sync();
+
+	apply_state_changes();
+	clear_state_changes();
 
-		case State::Hunting:
-			if (mass <= incubating_mass)
+	// Read by the next phases after they sync
+	#pragma omp single nowait
+	{
+		state_passes++;
+	}
+}
+
+inline size_t Simulation::active_agent(size_t k) const
+{
+	return k < woken.size() ? woken[k] : active_hunters[k - woken.size()];
+}
+
+void Simulation::collect_woken_incubators()
+{
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const size_t current_slot = state_passes % wheel_size;
+	// Stable between steps, every thread reads the same
+	const size_t agent_count = std::max<size_t>(last_agent_index, 1);
+
+	// 1: Sweep this thread's wheels, handing the due incubators to the
+	// thread sorting their range of agents
+	for (int t = 0; t < threads; t++)
+	{
+		due_incubators[thread * n_threads + t].clear();
+	}
+	for (size_t w = thread; w < wakeup_wheels.size(); w += threads)
+	{
+		std::vector<size_t>& slot = wakeup_wheels[w].slots[current_slot];
+		size_t kept = 0;
+		for (size_t i : slot)
+		{
+			if (states[i].load() != State::Incubating || wakeup_pass[i] % wheel_size != current_slot)
 			{
-				state.store(State::Incubating);
-				simulate_incubating(i);
+				continue;
 			}
-			else if (masses[i] >= splitting_mass)
+			if (wakeup_pass[i] == state_passes)
 			{
-				simulate_splitting(i);
+				const int sorter = (int)std::min<size_t>(i * threads / agent_count, threads - 1);
+				due_incubators[thread * n_threads + sorter].push_back(i);
 			}
-			else
+			else if (wakeup_pass[i] > state_passes)
 			{
-				simulate_hunting(i);
+				// Due on a later turn of the wheel
+				slot[kept++] = i;
 			}
-			break;
+		}
+		slot.resize(kept);
+	}
+	sync();
 
-		case State::Dead:
-			break;
+	// 2: Sort this thread's range. An agent rescheduled by another thread is
+	// on two wheels, its second entry is dropped here
+	std::vector<size_t>& part = thread_woken[thread];
+	part.clear();
+	for (int t = 0; t < threads; t++)
+	{
+		const std::vector<size_t>& due = due_incubators[t * n_threads + thread];
+		part.insert(part.end(), due.begin(), due.end());
+	}
+	std::sort(part.begin(), part.end());
+	part.erase(std::unique(part.begin(), part.end()), part.end());
+	woken_offsets[thread + 1] = part.size();
+	sync();
 
-		default:
-			break;
+	#pragma omp single nowait
+	{
+		woken_offsets[0] = 0;
+		for (int t = 0; t < threads; t++)
+		{
+			woken_offsets[t + 1] += woken_offsets[t];
 		}
+		woken.resize(woken_offsets[threads]);
+	}
+	sync();
+
+	// 3: The ranges are in agent order, so their concatenation is sorted
+	std::copy(part.begin(), part.end(), woken.begin() + woken_offsets[thread]);
+	for (size_t i : part)
+	{
+		wakeup_pass[i] = no_pass;
 	}
+	sync();
 }
 
-inline void Simulation::simulate_hunting(size_t index)
+void Simulation::rebuild_active_lists()
+{
+	const size_t n_words = AgentBits::word_count(last_agent_index);
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const size_t begin = n_words * thread / threads;
+	const size_t end = n_words * (thread + 1) / threads;
+
+	// 1: Count the hunters in this thread's words
+	thread_hunters[thread + 1] = hunting_agents.count(begin, end);
+	sync();
+
+	#pragma omp single nowait
+	{
+		thread_hunters[0] = 0;
+		for (int t = 0; t < threads; t++)
+		{
+			thread_hunters[t + 1] += thread_hunters[t];
+		}
+		active_hunters.resize(thread_hunters[threads]);
+	}
+	sync();
+
+	// 2: Write them in order after the hunters of the previous threads
+	size_t next_hunter = thread_hunters[thread];
+	for (size_t w = begin; w < end; w++)
+	{
+		hunting_agents.for_each_in_word(w, [&](size_t i)
+		{
+			active_hunters[next_hunter++] = i;
+		});
+	}
+	sync();
+}
+
+template<typename Params>
+inline bool Simulation::update_state(size_t index, const Params& p)
 {
-	vec2f& position = positions[index];
-	vec2f& movement = movements[index];
 	float& mass = masses[index];
+	std::atomic<State>& state = states[index];
 
-	// Move to the closer incubating agent
-	const std::vector<size_t>& nearby = spatial_index.close_to(position);
+	// Update state and take action
+	switch (state.load())
+	{
+	case State::Incubating:
+		// Only woken incubators get here, their mass is caught up first
+		if (mass_of(index) >= p.hunting_mass)
+		{
+			mass = mass_of(index);
+			set_state(index, State::Hunting);
+			state_changes[omp_get_thread_num()].push_back(index);
+			simulate_hunting(index, p);
+			return true;
+		}
+		schedule_wakeup(index, state_passes + 1, p);
+		return false;
 
-	// No one else nearby
-	if (nearby.empty() || (nearby.size() == 1 && nearby[0] == index))
+	case State::Hunting:
+		if (mass <= p.incubating_mass)
+		{
+			start_incubating(index, p);
+			set_state(index, State::Incubating);
+			state_changes[omp_get_thread_num()].push_back(index);
+			return true;
+		}
+		else if (mass >= p.splitting_mass)
+		{
+			simulate_splitting(index);
+		}
+		else
+		{
+			simulate_hunting(index, p);
+		}
+		return false;
+
+	case State::Dead:
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+void Simulation::apply_state_changes()
+{
+	// Hunters are reading the index while states change, so agents are only moved
+	// between partitions, and new prey announced to the cells, afterwards
+	#pragma omp for nowait
+	for (int t = 0; t < state_changes.size(); t++)
 	{
-		movement = vec2f(0.0f, 0.0f);
-		return;
+		for (const Move& move : deferred_moves[t])
+		{
+			spatial_index.moved(move.index, move.old_position, position_of(move.index));
+		}
+		for (size_t i : state_changes[t])
+		{
+			const State state = states[i].load();
+			if (index_backend == IndexBackend::Incremental)
+			{
+				spatial_index.changed_state(i, position_of(i), state);
+			}
+			if (state == State::Incubating)
+			{
+				prey_added[spatial_index.chunk_index(position_of(i))].store(state_passes + 1, std::memory_order_relaxed);
+			}
+		}
 	}
+	sync();
+}
+
+void Simulation::clear_state_changes()
+{
+	// Only the owner writes a thread's lists, and every thread is done reading them
+	state_changes[omp_get_thread_num()].clear();
+	deferred_moves[omp_get_thread_num()].clear();
+}
 
+template<typename Params>
+inline void Simulation::simulate_hunting(size_t index, const Params& p)
+{
+	vec2f position = position_of(index);
+	float& mass = masses[index];
+
+	// Move to the closer incubating agent in the neighborhood.
+	// Prey that started hunting this step is still in the incubating partition,
+	// eating it will fail when the eat is resolved
 	size_t closer_agent_index = no_agent;
 	float closer_distance_squared = std::numeric_limits<float>::infinity();
-	for (size_t agent : nearby)
+	vec2f closer_position;
+
+	// The position is the one in the index. Prey that started hunting may be
+	// moving on the fused pass, its copy in the index only changes after it
+	auto consider = [&](AgentRange prey, size_t slot, float squared_distance)
 	{
-		if (agent == index || states[agent] != State::Incubating)
-		{
-			continue;
-		}
-		float squared_distance = vec2f::squared_distance(position, positions[agent]);
-		if (squared_distance < closer_distance_squared)
+		const size_t agent = prey[slot];
+		if (squared_distance < closer_distance_squared ||
+			(squared_distance == closer_distance_squared && agent < closer_agent_index))
 		{
 			closer_agent_index = agent;
 			closer_distance_squared = squared_distance;
+			closer_position = vec2f(prey.x[slot], prey.y[slot]);
+		}
+	};
+
+	// Nearest of 'count' prey from slot 'first' of the range. The order of the agents in
+	// the index depends on thread timing, so the deterministic mode breaks ties by agent index
+	auto search = [&](AgentRange prey, size_t first, size_t count)
+	{
+		Nearest nearest = deterministic ?
+			NearestSearch::find_lowest_id(prey.x + first, prey.y + first, prey.first + first, count, position) :
+			NearestSearch::find(prey.x + first, prey.y + first, count, position);
+		if (nearest.slot != NearestSearch::no_slot)
+		{
+			nearest.slot += first;
+		}
+		return nearest;
+	};
+
+	auto find_closer = [&](AgentRange prey)
+	{
+		Nearest nearest = search(prey, 0, prey.size());
+		if (nearest.slot == NearestSearch::no_slot)
+		{
+			return;
+		}
+		if (prey[nearest.slot] != index)
+		{
+			consider(prey, nearest.slot, nearest.squared_distance);
+			return;
+		}
+
+		// An agent that started hunting on this step is still in the incubating
+		// partition and finds itself, the closest prey is on either side of it
+		const Nearest before = search(prey, 0, nearest.slot);
+		const Nearest after = search(prey, nearest.slot + 1, prey.size() - nearest.slot - 1);
+		for (const Nearest& side : { before, after })
+		{
+			if (side.slot != NearestSearch::no_slot)
+			{
+				consider(prey, side.slot, side.squared_distance);
+			}
 		}
+	};
+
+	// The last scan is reused while it still holds. A hunter without a target
+	// doesn't move, so it sleeps until prey is added near it
+	const NearCells cells = near_cells(position);
+	const bool rescan = !last_scan_holds(index, cells);
+
+	// Other hunters only matter when there is no prey around
+	bool anyone_nearby = false;
+	auto find_others = [&](AgentRange hunters)
+	{
+		anyone_nearby = anyone_nearby || hunters.size() > 1 || (hunters.size() == 1 && hunters[0] != index);
+	};
+
+	// Same distance the search computes, incubators are indexed where they are
+	if (!rescan && targets[index] != no_agent)
+	{
+		closer_agent_index = targets[index];
+		closer_position = position_of(closer_agent_index);
+		float dx = closer_position.x - position.x;
+		float dy = closer_position.y - position.y;
+		closer_distance_squared = dx * dx + dy * dy;
 	}
 
-	mass -= move_mass_cost;
+	// One chunk around the hunter, so agents across a chunk border are seen
+	if (index_backend == IndexBackend::Incremental)
+	{
+		float radius = spatial_index.chunk_size;
+		if (rescan)
+		{
+			spatial_index.for_each_near(position, radius, State::Incubating, find_closer);
+		}
+		if (closer_agent_index == no_agent)
+		{
+			spatial_index.for_each_near(position, radius, State::Hunting, find_others);
+		}
+	}
+	else
+	{
+		float radius = cell_list.cell_size;
+		if (rescan)
+		{
+			cell_list.for_each_near(position, radius, State::Incubating, find_closer);
+		}
+		if (closer_agent_index == no_agent)
+		{
+			cell_list.for_each_near(position, radius, State::Hunting, find_others);
+		}
+	}
+
+	if (rescan)
+	{
+		scanned_on[index] = state_passes;
+		targets[index] = closer_agent_index;
+		scanned_cells[index] = cells;
+	}
+
+	// No one else nearby
+	if (closer_agent_index == no_agent && !anyone_nearby)
+	{
+		set_movement(index, vec2f(0.0f, 0.0f));
+		return;
+	}
+
+	mass -= p.move_mass_cost;
 
 	// No target nearby
 	if (closer_agent_index == no_agent)
 	{
-		movement = vec2f(0.0f, 0.0f);
+		set_movement(index, vec2f(0.0f, 0.0f));
 		return;
 	}
 
 	// 'Eat' incubating agent if close enough
-	if (closer_distance_squared < (max_eat_distance * max_eat_distance))
+	if (closer_distance_squared < (p.max_eat_distance * p.max_eat_distance))
 	{
 		eaten[index] = closer_agent_index;
-		movement = vec2f(0.0f, 0.0f);
+		eaters[omp_get_thread_num()].hunters.push_back(index);
+		set_movement(index, vec2f(0.0f, 0.0f));
 		return;
 	}
 
-	vec2f destination_pos = positions[closer_agent_index];
-	movement = (position - destination_pos);
+	vec2f movement = (closer_position - position);
 	movement.normalize();
+	set_movement(index, movement);
+}
+
+inline Simulation::NearCells Simulation::near_cells(vec2f position) const
+{
+	// Same bounds as for_each_near
+	const float radius = spatial_index.chunk_size;
+	const int divisions = spatial_index.divisions_per_dimension;
+	NearCells cells;
+	cells.min_x = std::max((int)((position.x - radius + params.map_size) / radius), 0);
+	cells.min_y = std::max((int)((position.y - radius + params.map_size) / radius), 0);
+	cells.max_x = std::min((int)((position.x + radius + params.map_size) / radius), divisions - 1);
+	cells.max_y = std::min((int)((position.y + radius + params.map_size) / radius), divisions - 1);
+	return cells;
 }
 
-inline void Simulation::simulate_incubating(size_t index)
+inline bool Simulation::prey_added_near(const NearCells& cells, size_t since) const
 {
-	movements[index] = vec2f(0.0f, 0.0f);
-	masses[index] += incubate_mass_reward;
+	const int divisions = spatial_index.divisions_per_dimension;
+	for (int y = cells.min_y; y <= cells.max_y; y++)
+	{
+		for (int x = cells.min_x; x <= cells.max_x; x++)
+		{
+			if (prey_added[x + y * divisions].load(std::memory_order_relaxed) > since)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+inline bool Simulation::last_scan_holds(size_t index, const NearCells& cells) const
+{
+	// Prey in the scanned cells can only have gone since, and the hunter moved
+	// straight to its target, so nothing got closer to it than the target
+	const size_t scan_pass = scanned_on[index];
+	if (scan_pass == no_pass || !(cells == scanned_cells[index]) || prey_added_near(cells, scan_pass))
+	{
+		return false;
+	}
+
+	const size_t target = targets[index];
+	if (target == no_agent)
+	{
+		return true;
+	}
+
+	// Hunters stop at eating distance, so they never pass their target unless
+	// a step is longer than that. One that can may end up nearer other prey
+	if (step_delta > params.max_eat_distance)
+	{
+		return false;
+	}
+
+	// Incubators woken on this pass may start hunting while the state is read
+	if (std::binary_search(woken.begin(), woken.end(), target))
+	{
+		return false;
+	}
+
+	// The target may have died and its slot been reused. A new agent there started
+	// incubating after the scan, and it writes incubation_start before its state
+	return states[target].load() == State::Incubating && incubation_start[target] <= scan_pass;
+}
+
+template<typename Params>
+inline void Simulation::start_incubating(size_t index, const Params& p)
+{
+	// The reward of this pass is counted once state_passes goes up
+	set_movement(index, vec2f(0.0f, 0.0f));
+	incubation_start[index] = state_passes;
+	scanned_on[index] = no_pass;
+	schedule_wakeup(index, state_passes + 1, p);
+}
+
+template<typename Params>
+inline void Simulation::schedule_wakeup(size_t index, size_t earliest_pass, const Params& p)
+{
+	// Same sum as mass_of, so the incubator is over hunting_mass when it wakes up.
+	// A tiny reward or a huge hunting_mass could need more passes than a size_t
+	// holds, or than a float counts exactly, so the wait saturates instead
+	const float mass = masses[index];
+	const float estimate = std::ceil((p.hunting_mass - mass) / p.incubate_mass_reward);
+	size_t passes = estimate < (float)max_wakeup_passes ? (size_t)std::max(0.0f, estimate) : max_wakeup_passes;
+	while (passes > 0 && mass + p.incubate_mass_reward * (float)(passes - 1) >= p.hunting_mass)
+	{
+		passes--;
+	}
+	while (passes < max_wakeup_passes && mass + p.incubate_mass_reward * (float)passes < p.hunting_mass)
+	{
+		passes++;
+	}
+
+	const size_t pass = std::max(incubation_start[index] + passes, earliest_pass);
+	wakeup_pass[index] = pass;
+	wakeup_wheels[omp_get_thread_num()].slots[pass % wheel_size].push_back(index);
 }
 
 inline void Simulation::simulate_splitting(size_t index)
 {
 	float& mass = masses[index];
 	mass = mass / 2.0f;
-	vec2f new_position = positions[index] + vec2f(1.0f, 1.0f);
-	spawn_agent(
-		new_position,
-		mass,
-		State::Hunting);
+	vec2f new_position = position_of(index) + vec2f(1.0f, 1.0f);
+	spawn_buffers[omp_get_thread_num()].spawns.push_back({ index, new_position, mass });
 }
 
 void Simulation::update_positions(float delta)
 {
-	#pragma omp parallel for num_threads(n_threads)
-	for (int i = 0; i < last_agent_index; i++)
+	with_params([&](const auto& p)
 	{
-		State current_state = states[i].load();
-		if (current_state == State::Hunting)
+		// Hunters from the end of the last step that are still hunting
+		scheduler.for_each("positions", active_hunters.size(), Scheduler::default_block_size, position_pass_bytes, [&](size_t k)
 		{
-			vec2f& position = positions[i];
-			vec2f& movement = movements[i];
-			vec2f old_position = position;
-
-			// Update position
-			position.x += movement.x * delta;
-			position.y += movement.y * delta;
+			size_t i = active_hunters[k];
+			if (states[i].load() == State::Hunting)
+			{
+				move_agent(i, delta, true, p);
+			}
+		});
 
-			// Map collision
-			if (position.x < -map_size)
+		// Agents that started hunting this step, none of them is in the list above
+		#pragma omp for nowait
+		for (int t = 0; t < state_changes.size(); t++)
+		{
+			for (size_t i : state_changes[t])
 			{
-				position.x = -map_size;
+				if (states[i].load() == State::Hunting)
+				{
+					move_agent(i, delta, true, p);
+				}
 			}
-			if (position.x > map_size)
+		}
+	});
+	sync();
+
+	clear_state_changes();
+}
+
+template<typename Params>
+inline void Simulation::move_agent(size_t index, float delta, bool update_index, const Params& p)
+{
+	vec2f old_position = position_of(index);
+	vec2f position = old_position;
+
+	// Update position
+	position.x += mov_x[index] * delta;
+	position.y += mov_y[index] * delta;
+
+	// Map collision
+	if (position.x < -p.map_size)
+	{
+		position.x = -p.map_size;
+	}
+	if (position.x > p.map_size)
+	{
+		position.x = p.map_size;
+	}
+	if (position.y < -p.map_size)
+	{
+		position.y = -p.map_size;
+	}
+	if (position.y > p.map_size)
+	{
+		position.y = p.map_size;
+	}
+	pos_x[index] = position.x;
+	pos_y[index] = position.y;
+
+	// Update index
+	if (update_index && index_backend == IndexBackend::Incremental)
+	{
+		spatial_index.moved(index, old_position, position);
+	}
+}
+
+void Simulation::spawn_agents()
+{
+	if (deterministic)
+	{
+		spawn_agents_ordered();
+		return;
+	}
+
+	#pragma omp for nowait
+	for (int t = 0; t < spawn_buffers.size(); t++)
+	{
+		std::vector<Spawn>& spawns = spawn_buffers[t].spawns;
+		size_t agent_index_end = 0;
+		size_t n_spawned = 0;
+		for (const Spawn& spawn : spawns)
+		{
+			size_t i = slot_allocator.allocate(omp_get_thread_num());
+			if (i == SlotAllocator::no_slot)
 			{
-				position.x = map_size;
+				LOG(WARNING) << "Failed to create new agent";
+				break;
 			}
-			if (position.y < -map_size)
+			spawn_agent(i, spawn.position, spawn.mass, State::Hunting);
+			agent_index_end = std::max(agent_index_end, i + 1);
+			n_spawned++;
+		}
+		spawns.clear();
+
+		std::scoped_lock lock(last_agent_index_mutex);
+		last_agent_index = std::max(last_agent_index, agent_index_end);
+		n_living_agents += n_spawned;
+	}
+	sync();
+}
+
+void Simulation::spawn_agents_ordered()
+{
+	#pragma omp single nowait
+	{
+		ordered_spawns.clear();
+		for (SpawnBuffer& buffer : spawn_buffers)
+		{
+			ordered_spawns.insert(ordered_spawns.end(), buffer.spawns.begin(), buffer.spawns.end());
+			buffer.spawns.clear();
+		}
+		std::sort(ordered_spawns.begin(), ordered_spawns.end(), [](const Spawn& lhs, const Spawn& rhs)
+		{
+			return lhs.parent < rhs.parent;
+		});
+
+		ordered_slots.clear();
+		slot_allocator.allocate_lowest(ordered_spawns.size(), ordered_slots);
+		if (ordered_slots.size() < ordered_spawns.size())
+		{
+			LOG(WARNING) << "Failed to create " << ordered_spawns.size() - ordered_slots.size() << " new agents";
+		}
+
+		if (!ordered_slots.empty())
+		{
+			last_agent_index = std::max(last_agent_index, ordered_slots.back() + 1);
+		}
+		n_living_agents += ordered_slots.size();
+	}
+	sync();
+
+	#pragma omp for nowait
+	for (int k = 0; k < ordered_slots.size(); k++)
+	{
+		const Spawn& spawn = ordered_spawns[k];
+		spawn_agent(ordered_slots[k], spawn.position, spawn.mass, State::Hunting);
+	}
+	sync();
+}
+
+void Simulation::compact_agents()
+{
+	const size_t agent_count = last_agent_index;
+	const int thread = omp_get_thread_num();
+	const int threads = omp_get_num_threads();
+	const size_t begin = partition_bound(agent_count, thread, threads);
+	const size_t end = partition_bound(agent_count, thread + 1, threads);
+	Compaction& c = compaction;
+
+	#pragma omp single nowait
+	{
+		c.new_indices.assign(pos_x.size(), no_agent);
+		c.thread_living.assign(threads + 1, 0);
+		c.pos_x.resize(agent_count);
+		c.pos_y.resize(agent_count);
+		c.mov_x.resize(agent_count);
+		c.mov_y.resize(agent_count);
+		c.masses.resize(agent_count);
+		c.eaten.resize(agent_count);
+		c.incubation_start.resize(agent_count);
+		c.wakeup_pass.resize(agent_count);
+		c.scanned_on.resize(agent_count);
+		c.targets.resize(agent_count);
+		c.scanned_cells.resize(agent_count);
+		c.states.resize(agent_count);
+	}
+	sync();
+
+	// 1: Count living agents on this thread's range
+	size_t living = 0;
+	for (size_t i = begin; i < end; i++)
+	{
+		if (states[i].load() != State::Dead)
+		{
+			living++;
+		}
+	}
+	c.thread_living[thread + 1] = living;
+	sync();
+
+	#pragma omp single nowait
+	{
+		for (int t = 0; t < threads; t++)
+		{
+			c.thread_living[t + 1] += c.thread_living[t];
+		}
+		c.living_count = c.thread_living[threads];
+	}
+	sync();
+
+	// 2: Give each living agent its new index, in the same order
+	size_t next_index = c.thread_living[thread];
+	for (size_t i = begin; i < end; i++)
+	{
+		if (states[i].load() == State::Dead)
+		{
+			continue;
+		}
+		c.new_indices[i] = next_index;
+		c.pos_x[next_index] = pos_x[i];
+		c.pos_y[next_index] = pos_y[i];
+		c.mov_x[next_index] = mov_x[i];
+		c.mov_y[next_index] = mov_y[i];
+		c.masses[next_index] = masses[i];
+		c.incubation_start[next_index] = incubation_start[i];
+		c.wakeup_pass[next_index] = wakeup_pass[i];
+		c.scanned_on[next_index] = scanned_on[i];
+		c.scanned_cells[next_index] = scanned_cells[i];
+		c.states[next_index] = states[i].load();
+		next_index++;
+	}
+	sync();
+
+	// 3: Eaten agents and targets point to agents of other threads, so they are
+	// remapped once every new index is known
+	for (size_t i = begin; i < end; i++)
+	{
+		if (c.new_indices[i] != no_agent)
+		{
+			size_t target = eaten[i];
+			c.eaten[c.new_indices[i]] = target == no_agent ? no_agent : c.new_indices[target];
+
+			// A hunter whose target died has to look again
+			target = targets[i];
+			c.targets[c.new_indices[i]] = target == no_agent ? no_agent : c.new_indices[target];
+			if (target != no_agent && c.new_indices[target] == no_agent)
 			{
-				position.y = -map_size;
+				c.scanned_on[c.new_indices[i]] = no_pass;
 			}
-			if (position.y > map_size)
+		}
+	}
+	sync();
+
+	// 4: Copy back in place, the arrays are never reallocated since
+	// the visualization may be reading them
+	const size_t living_count = c.living_count;
+	const size_t copy_begin = partition_bound(living_count, thread, threads);
+	const size_t copy_end = partition_bound(living_count, thread + 1, threads);
+	for (size_t i = copy_begin; i < copy_end; i++)
+	{
+		pos_x[i] = c.pos_x[i];
+		pos_y[i] = c.pos_y[i];
+		mov_x[i] = c.mov_x[i];
+		mov_y[i] = c.mov_y[i];
+		masses[i] = c.masses[i];
+		eaten[i] = c.eaten[i];
+		incubation_start[i] = c.incubation_start[i];
+		wakeup_pass[i] = c.wakeup_pass[i];
+		scanned_on[i] = c.scanned_on[i];
+		targets[i] = c.targets[i];
+		scanned_cells[i] = c.scanned_cells[i];
+		states[i].store(c.states[i]);
+	}
+
+	// Everything after the living agents is free now
+	const size_t dead_begin = std::max(living_count, begin);
+	const size_t dead_end = std::max(living_count, end);
+	for (size_t i = dead_begin; i < dead_end; i++)
+	{
+		states[i].store(State::Dead);
+		eaten[i] = no_agent;
+	}
+	sync();
+
+	rebuild_state_bits(agent_count);
+
+	// Wakeups of dead agents are dropped, they would be skipped anyway
+	#pragma omp for nowait
+	for (int t = 0; t < wakeup_wheels.size(); t++)
+	{
+		for (std::vector<size_t>& slot : wakeup_wheels[t].slots)
+		{
+			size_t kept = 0;
+			for (size_t i : slot)
 			{
-				position.y = map_size;
+				if (c.new_indices[i] != no_agent)
+				{
+					slot[kept++] = c.new_indices[i];
+				}
 			}
+			slot.resize(kept);
+		}
+	}
 
-			// Update index
-			spatial_index.moved(i, old_position, position);
+	#pragma omp single nowait
+	{
+		// Hunters still waiting to eat moved too
+		for (EaterBuffer& buffer : eaters)
+		{
+			for (size_t& hunter : buffer.hunters)
+			{
+				hunter = c.new_indices[hunter];
+			}
 		}
+
+		slot_allocator.reset(living_count);
+		last_agent_index = living_count;
+		n_living_agents = living_count;
 	}
 
+	if (index_backend == IndexBackend::Incremental)
+	{
+		spatial_index.remap(c.new_indices);
+	}
+	sync();
 }
 
-int Simulation::spawn_agent(vec2f position, float mass, State state)
+inline void Simulation::set_state(size_t index, State state)
 {
-	for (int i = 0; i < positions.size(); i++)
+	states[index].store(state);
+	if (state == State::Hunting)
 	{
-		State dead = State::Dead;
-		if (states[i].compare_exchange_strong(dead, state))
+		hunting_agents.set(index);
+	}
+	else
+	{
+		hunting_agents.clear(index);
+	}
+}
+
+void Simulation::rebuild_state_bits(size_t agent_count)
+{
+	// Each word is built by a single thread, so it is stored whole
+	const int n_words = (int)AgentBits::word_count(agent_count);
+	#pragma omp for nowait
+	for (int w = 0; w < n_words; w++)
+	{
+		uint64_t hunting = 0;
+		const size_t first = (size_t)w * AgentBits::bits_per_word;
+		const size_t last = std::min(first + AgentBits::bits_per_word, agent_count);
+		for (size_t i = first; i < last; i++)
 		{
+			if (states[i].load() == State::Hunting)
 			{
-				std::unique_lock<std::mutex>(last_agent_index_mutex);
-				if (i > last_agent_index)
-				{
-					last_agent_index = i;
-				}
+				hunting |= uint64_t(1) << (i - first);
 			}
-			// Can't modify spatial index, other threads are reading it
-			// or have references to chunks
-			positions[i] = position;
-			masses[i] = mass;
-			return i;
 		}
+		hunting_agents.store_word(w, hunting);
 	}
+	sync();
+}
 
-	LOG(WARNING) << "Failed to create new agent";
-	return -1;
+void Simulation::spawn_agent(size_t index, vec2f position, float mass, State state)
+{
+	pos_x[index] = position.x;
+	pos_y[index] = position.y;
+	set_movement(index, vec2f(0.0f, 0.0f));
+	masses[index] = mass;
+	scanned_on[index] = no_pass;
+	set_state(index, state);
+	if (index_backend == IndexBackend::Incremental)
+	{
+		spatial_index.set(index, position, state);
+	}
 }
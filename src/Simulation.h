@@ -4,8 +4,18 @@
 #include <vector>
 #include <atomic>
 #include "SpatialIndex.h"
+#include "CellList.h"
+#include "NearestSearch.h"
+#include "SlotAllocator.h"
+#include "AgentBits.h"
+#include "AlignedAllocator.h"
+#include "Scheduler.h"
+#include "SpinBarrier.h"
+#include "State.h"
 #include "vec2f.h"
 #include "Settings.h"
+#include "SimulationParams.h"
+#include "Checkpoint.h"
 
 /*
 	PALS
@@ -29,18 +39,18 @@
 		Collision computing will be done sequentially
 */
 
-// Possible states for each agent
-enum class State {
-	Incubating,	// Standing still and gaining mass
-	Hunting,	// Moving, trying to absorb other agents, spending mass
-	Dead		// Dead
-};
-
 struct EntityActionResult {
 	vec2f movement;
 	bool divide;
 };
 
+// Agent created by a split, added to the simulation at the end of the step
+struct Spawn {
+	size_t parent;
+	vec2f position;
+	float mass;
+};
+
 // Contains all simulation logic and data
 class Simulation
 {
@@ -55,16 +65,55 @@ public:
 	void run();
 
 	// A step of the simulation updates each agent state and it's position.
+	// Called by every thread of the run's team, each phase ends with the team in sync.
 	void step(float delta);
 
 	// The simulation data is organized in a data oriented fashion.
 	// Each index in the data structures represents an agent.
 	// The simulation space is a 2D continuous map centered at (0.0, 0.0).
-	std::vector<vec2f> movements;           // Planned movement data.
-	std::vector<vec2f> positions;           // Position data.
-	std::vector<float> masses;              // Mass data.
-	std::vector<size_t> eaten;              // Eaten entity index.
-	std::vector<std::atomic<State>> states;	// States data.
+	// Each component lives in its own cache line aligned array.
+	AlignedVector<float> mov_x;             // Planned movement data.
+	AlignedVector<float> mov_y;
+	AlignedVector<float> pos_x;             // Position data.
+	AlignedVector<float> pos_y;
+	AlignedVector<float> masses;            // Mass data.
+	AlignedVector<size_t> eaten;            // Eaten entity index.
+	AtomicArray<State> states;	// States data.
+
+	inline vec2f position_of(size_t index) const
+	{
+		return vec2f(pos_x[index], pos_y[index]);
+	}
+
+	inline void set_movement(size_t index, vec2f movement)
+	{
+		mov_x[index] = movement.x;
+		mov_y[index] = movement.y;
+	}
+
+	// Mass of agent 'index'. Incubators gain mass every state pass, which is only
+	// added to masses when they wake up, so theirs is computed from the passes since they started
+	inline float mass_of(size_t index) const
+	{
+		if (states[index].load() != State::Incubating)
+		{
+			return masses[index];
+		}
+		return masses[index] + params.incubate_mass_reward * (float)(state_passes - incubation_start[index]);
+	}
+
+	// Agents in a cache line of states, the array with the smallest elements. A multiple
+	// of it starts a line in every agent array. Agent arrays are padded to a multiple of it
+	static constexpr size_t agents_per_line = cache_line_size / sizeof(State);
+
+	// First agent of part 'part' when splitting [0, count) in 'parts', rounded to
+	// agents_per_line so two parts never write the same line of any agent array.
+	// The agent loops split the active lists instead, where the parts of two threads
+	// meet they can write the same lines, as can the tiles of the dynamic schedules
+	static size_t partition_bound(size_t count, int part, int parts);
+
+	// Hunters, one bit per index. Kept in sync with states by set_state
+	AgentBits hunting_agents;
 
 	// Numebr of threads the simulation will use
 	int n_threads;
@@ -72,43 +121,246 @@ public:
 	// Number of iterations the simulation will run for.
 	int n_iterations;
 
-	// Current higher index for a living agent
+	// One past the highest index used by a living agent
 	std::mutex last_agent_index_mutex;
 	size_t last_agent_index;
 
-	// State of the simulation.
-	bool is_done = false;
+	// Number of living agents
+	size_t n_living_agents;
 
-	// Constant map dimension size.
-	// Map goes from [-map_size, +map_size]
-	static constexpr float map_size = 512;
+	// Number of steps simulated so far
+	size_t step_count = 0;
 
-	// Threshold for an agent go back to incubating state.
-	static constexpr float incubating_mass = 1.0f;
+	// Number of state update passes done, it goes up right after each pass
+	size_t state_passes = 0;
 
-	// Threshold for an agent start hunting.
-	static constexpr float hunting_mass = 2.0f;
+	// Pack living agents every this many steps, 0 disables it
+	int compact_every;
 
-	// Threshold for an agent to split it self in two.
-	static constexpr float splitting_mass = 10.0f;
+	// Pack living agents when this fraction of [0, last_agent_index) is dead
+	float compact_threshold;
 
-	// Cost in mass for an agent to move.
-	static constexpr float move_mass_cost = 0.01f;
+	// Update state and position of each agent in one pass instead of separate ones
+	bool fused_step;
 
-	// Reward in mass for an agent to incubate
-	static constexpr float incubate_mass_reward = 0.1f;
+	// Time simulated by each step. Hunters move this far on a step
+	static constexpr float step_delta = 0.05f;
 
-	// Maximum distance between two agents so one can eat the other
-	static constexpr float max_eat_distance = 1.0f;
+	// Agents handed out at once on the fused pass by the dynamic and stealing schedules
+	static constexpr int tile_size = 4096;
+
+	// Agent array bytes each pass reads or writes per agent it visits, a model of the traffic
+	// in the balance log, not a measurement: the index, the prey search and cache misses
+	// aren't counted. The state pass reads state, mass and position and writes the movement, the
+	// position pass reads state and movement and rewrites the position. The fused pass does
+	// both while the position and movement are still in cache, so they are counted once
+	static constexpr size_t state_pass_bytes = sizeof(State) + 5 * sizeof(float);
+	static constexpr size_t position_pass_bytes = sizeof(State) + 6 * sizeof(float);
+	static constexpr size_t fused_pass_bytes = sizeof(State) + 7 * sizeof(float);
+
+	// Pin the threads of the run to CPUs spread over the NUMA nodes
+	bool pin_threads;
+
+	// Resolve every conflict by a fixed rule, so results don't depend on the number of threads.
+	// Spawned agents get the lowest free slots in parent order and nearest prey ties go to the lowest index
+	bool deterministic;
+
+	// State of the simulation.
+	bool is_done = false;
+
+	// False when the checkpoint to start from couldn't be restored. Running
+	// then does nothing, the caller reports the failure
+	bool is_ready = true;
+
+	// Save the simulation every this many steps, 0 disables it
+	int checkpoint_every;
+
+	// File checkpoints are saved to
+	std::string checkpoint_file;
+
+	// Tunables, the kernels get them as constants when they are the defaults
+	const SimulationParams params;
 
 private:
 
 	const size_t no_agent = std::numeric_limits<size_t>::max();
 
+	// Which spatial index is kept up to date
+	IndexBackend index_backend;
+
 	// Spatial index for efficient position-based lookups
 	SpatialIndex spatial_index;
 
-	// Update eaten agents.
+	// Alternative spatial index, rebuilt every step
+	CellList cell_list;
+
+	// Free agent slots, dead agents go back to it as soon as they are eaten
+	SlotAllocator slot_allocator;
+
+	// Lowest hunter index that wants to eat each agent
+	AtomicArray<size_t> claims;
+
+	// State pass from which each cell last had a new incubator in the index, 0 if never.
+	// Only written between passes. Both index backends use the same grid, so the cells are the ones a hunter scans
+	std::vector<std::atomic<size_t>> prey_added;
+
+	// Splits the agent loops between threads
+	Scheduler scheduler;
+
+	// Where the threads of the run meet between phases
+	SpinBarrier barrier;
+
+	// Snapshot of the last checkpoint and the thread writing it
+	Checkpoint checkpoint;
+
+	// Cells a hunter's prey scan visits, the ones for_each_near visits with a radius of one cell
+	struct NearCells {
+		int min_x;
+		int min_y;
+		int max_x;
+		int max_y;
+
+		bool operator==(const NearCells& other) const
+		{
+			return min_x == other.min_x && min_y == other.min_y && max_x == other.max_x && max_y == other.max_y;
+		}
+	};
+
+	// Scratch space of compact_agents, shared by the team
+	struct Compaction {
+		std::vector<size_t> new_indices;
+		std::vector<size_t> thread_living;
+		size_t living_count = 0;
+		AlignedVector<float> pos_x;
+		AlignedVector<float> pos_y;
+		AlignedVector<float> mov_x;
+		AlignedVector<float> mov_y;
+		AlignedVector<float> masses;
+		AlignedVector<size_t> eaten;
+		AlignedVector<size_t> incubation_start;
+		AlignedVector<size_t> wakeup_pass;
+		AlignedVector<size_t> scanned_on;
+		AlignedVector<size_t> targets;
+		AlignedVector<NearCells> scanned_cells;
+		std::vector<State> states;
+	};
+	Compaction compaction;
+
+	// Agents eaten on the step, to be removed from the spatial index
+	std::vector<size_t> removed_agents;
+
+	// Scratch space to order the spawns when deterministic
+	std::vector<Spawn> ordered_spawns;
+	std::vector<size_t> ordered_slots;
+
+	// Splits recorded during the step, per thread.
+	// Padded so two threads never write the same cache line
+	struct alignas(64) SpawnBuffer {
+		std::vector<Spawn> spawns;
+	};
+	std::vector<SpawnBuffer> spawn_buffers;
+
+	// Hunters that tried to eat on the step, and then the agents they ate, per thread
+	struct alignas(64) EaterBuffer {
+		std::vector<size_t> hunters;
+		std::vector<size_t> eaten;
+	};
+	std::vector<EaterBuffer> eaters;
+
+	// Agents that switched between incubating and hunting this step, per thread
+	std::vector<std::vector<size_t>> state_changes;
+
+	// Hunter that moved on the fused pass, with the position it was indexed at
+	struct Move {
+		size_t index;
+		vec2f old_position;
+	};
+
+	// Moves of the fused pass, per thread. Hunters look at each other's
+	// partition of the index during the pass, so it only changes afterwards
+	std::vector<std::vector<Move>> deferred_moves;
+
+	// Indices of the hunters, in increasing order, rebuilt at the end of each step.
+	// They may have changed state or died since
+	std::vector<size_t> active_hunters;
+
+	// Where each thread writes its part of the hunter list, only used while rebuilding it
+	std::vector<size_t> thread_hunters;
+
+	// State pass each incubator started incubating on, masses holds its mass at that point
+	AlignedVector<size_t> incubation_start;
+
+	// State pass each incubator will reach hunting_mass on
+	AlignedVector<size_t> wakeup_pass;
+
+	// Incubators to wake up, by wakeup pass modulo wheel_size, per thread.
+	// Entries of agents that died or were rescheduled are dropped when their slot comes up
+	struct alignas(64) WakeupWheel {
+		std::vector<std::vector<size_t>> slots;
+	};
+	std::vector<WakeupWheel> wakeup_wheels;
+
+	static constexpr size_t wheel_size = 64;
+
+	static constexpr size_t no_pass = std::numeric_limits<size_t>::max();
+
+	// Most passes an incubator waits before waking up. No run gets that far
+	static constexpr size_t max_wakeup_passes = std::numeric_limits<uint32_t>::max();
+
+	// Incubators waking up on the current pass, in increasing order
+	std::vector<size_t> woken;
+
+	// Incubators due on the current pass found on the wheel of each thread, one list per
+	// thread that sorts a range of agents, at [wheel thread * n_threads + sorting thread].
+	// Only used while collecting them
+	std::vector<std::vector<size_t>> due_incubators;
+
+	// Woken incubators of each thread's range of agents and where they go in woken
+	std::vector<std::vector<size_t>> thread_woken;
+	std::vector<size_t> woken_offsets;
+
+	// State pass of each hunter's last prey scan, or no_pass if the next one can't be skipped
+	AlignedVector<size_t> scanned_on;
+
+	// Nearest prey found by each hunter's last scan, or no_agent
+	AlignedVector<size_t> targets;
+
+	// Cells each hunter's last scan visited
+	AlignedVector<NearCells> scanned_cells;
+
+	// Chunks per dimension for the spatial index
+	static int grid_divisions(const Settings& settings);
+
+	// Size the agent arrays and clear them with 'threads' threads, each writing the
+	// agents it will work on, so their memory is on its NUMA node. The first 'live_count'
+	// agents are split the way the run splits the living agents, the rest evenly.
+	void initialize_agent_arrays(size_t capacity, size_t live_count, int threads);
+
+	// Wait for the rest of the team. Does nothing outside the run's parallel region.
+	void sync();
+
+	// Copy the state into the checkpoint snapshot and have it written in the background.
+	// Called by every thread of the team between two steps.
+	void save_checkpoint();
+
+	// Load the state saved at 'path' into a simulation that was just constructed.
+	// Returns false, leaving the simulation untouched, if the checkpoint doesn't fit it.
+	// The constructor then stops the process.
+	bool restore_checkpoint(const std::string& path);
+
+	// Call visit(array) with each agent array a checkpoint holds, always in the same order.
+	template<typename Visitor>
+	void for_each_saved_array(Visitor&& visit);
+
+	// Arrays for_each_saved_array visits
+	static constexpr size_t saved_array_count = 11;
+
+	// Call body(p) with the parameters as FixedParams when they are a set the kernels
+	// are compiled for, and as the runtime SimulationParams otherwise.
+	template<typename Body>
+	void with_params(Body&& body);
+
+	// Update eaten agents, only visiting the hunters that tried to eat.
 	void update_eaten_agents(float delta);
 
 	// Update states of all living agents.
@@ -117,15 +369,80 @@ private:
 	// Update position of all living agents;
 	void update_positions(float delta);
 
-	// Spawn a new agent at an available position.
-	int spawn_agent(vec2f position, float mass, State state);
+	// Update states and then positions of all living agents, a tile at a time.
+	void update_agents_fused(float delta);
+
+	// Move agents that changed state into their new spatial index partition,
+	// and the hunters of the fused pass to their new chunk.
+	void apply_state_changes();
+
+	// Forget the state changes of the step.
+	void clear_state_changes();
+
+	// Collect the indices of living hunters from their bits.
+	void rebuild_active_lists();
+
+	// Move the incubators due on the current pass from the wheels to woken.
+	void collect_woken_incubators();
+
+	// Agent at position 'k' of the woken incubators followed by the hunters.
+	inline size_t active_agent(size_t k) const;
+
+	// Agent 'index' eats 'eaten_index', if nobody else got it first.
+	inline bool eat(size_t index, size_t eaten_index);
+
+	// Update the state of an agent and take its action. Returns whether the state changed.
+	template<typename Params>
+	inline bool update_state(size_t index, const Params& p);
+
+	// Move an agent and optionally update its place in the spatial index.
+	template<typename Params>
+	inline void move_agent(size_t index, float delta, bool update_index, const Params& p);
+
+	// Add the agents split during the step to the simulation and the spatial index.
+	void spawn_agents();
+
+	// Move living agents to the front of the data, keeping their order,
+	// and lower last_agent_index to the number of living agents.
+	void compact_agents();
+
+	// Spawn the agents split during the step in the lowest free slots, in parent order.
+	void spawn_agents_ordered();
+
+	// Change the state of agent 'index' and its hunter bit.
+	inline void set_state(size_t index, State state);
+
+	// Recompute the hunter bits of [0, agent_count) from the states.
+	void rebuild_state_bits(size_t agent_count);
+
+	// Spawn a new agent in a free slot.
+	void spawn_agent(size_t index, vec2f position, float mass, State state);
+
+	// Hunter 'index' wants to eat 'eaten_index', the lowest hunter index claiming it wins.
+	inline void claim(size_t index, size_t eaten_index);
 
 	// Defines wheter simulation should be rendered.
 	bool has_visualization;
 
-	inline void simulate_hunting(size_t index);
+	template<typename Params>
+	inline void simulate_hunting(size_t index, const Params& p);
+
+	// Cells the prey scan of a hunter at position visits.
+	inline NearCells near_cells(vec2f position) const;
+
+	// Whether an incubator was added to 'cells' after state pass 'since'.
+	inline bool prey_added_near(const NearCells& cells, size_t since) const;
+
+	// Whether the last prey scan of hunter 'index' would find the same target if done again from 'cells'.
+	inline bool last_scan_holds(size_t index, const NearCells& cells) const;
+
+	// Agent 'index' starts incubating on the current pass, its mass now grows without visiting it.
+	template<typename Params>
+	inline void start_incubating(size_t index, const Params& p);
 
-	inline void simulate_incubating(size_t index);
+	// Put incubator 'index' on the wheel for the pass it reaches hunting_mass, not before 'earliest_pass'.
+	template<typename Params>
+	inline void schedule_wakeup(size_t index, size_t earliest_pass, const Params& p);
 
 	inline void simulate_splitting(size_t index);
 };
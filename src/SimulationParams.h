@@ -0,0 +1,109 @@
+#pragma once
+#include <cmath>
+#include <string>
+#include <utility>
+
+// Tunables of the simulation, read from the settings.
+// The defaults are the values the simulation was written for
+struct SimulationParams {
+
+	// Map goes from [-map_size, +map_size]
+	float map_size = 512;
+
+	// Threshold for an agent go back to incubating state.
+	float incubating_mass = 1.0f;
+
+	// Threshold for an agent start hunting.
+	float hunting_mass = 2.0f;
+
+	// Threshold for an agent to split it self in two.
+	float splitting_mass = 10.0f;
+
+	// Cost in mass for an agent to move.
+	float move_mass_cost = 0.01f;
+
+	// Reward in mass for an agent to incubate
+	float incubate_mass_reward = 0.1f;
+
+	// Maximum distance between two agents so one can eat the other
+	float max_eat_distance = 1.0f;
+
+	// Why the simulation can't run with these values, empty when it can
+	std::string invalid_reason() const
+	{
+		const std::pair<const char*, float> values[] = {
+			{ "--map-size", map_size },
+			{ "--incubating-mass", incubating_mass },
+			{ "--hunting-mass", hunting_mass },
+			{ "--splitting-mass", splitting_mass },
+			{ "--move-cost", move_mass_cost },
+			{ "--incubate-reward", incubate_mass_reward },
+			{ "--eat-distance", max_eat_distance },
+		};
+		for (const auto& [flag, value] : values)
+		{
+			if (!std::isfinite(value))
+			{
+				return std::string(flag) + " must be a finite number";
+			}
+		}
+
+		if (!(max_eat_distance > 0.0f))
+		{
+			return "--eat-distance must be over 0";
+		}
+		if (!(incubate_mass_reward > 0.0f))
+		{
+			return "--incubate-reward must be over 0, incubators would never start hunting";
+		}
+		if (!(move_mass_cost >= 0.0f))
+		{
+			return "--move-cost can't be negative";
+		}
+		if (!(incubating_mass < hunting_mass))
+		{
+			return "--incubating-mass must be under --hunting-mass";
+		}
+		if (!(splitting_mass > 0.0f))
+		{
+			return "--splitting-mass must be over 0";
+		}
+		if (!(map_size > splitting_mass))
+		{
+			return "--map-size must be over --splitting-mass, agents start at least that far from the edges";
+		}
+		return {};
+	}
+
+	bool operator==(const SimulationParams& other) const
+	{
+		return map_size == other.map_size &&
+			incubating_mass == other.incubating_mass &&
+			hunting_mass == other.hunting_mass &&
+			splitting_mass == other.splitting_mass &&
+			move_mass_cost == other.move_mass_cost &&
+			incubate_mass_reward == other.incubate_mass_reward &&
+			max_eat_distance == other.max_eat_distance;
+	}
+
+	bool operator!=(const SimulationParams& other) const
+	{
+		return !(*this == other);
+	}
+};
+
+// Parameter set the agent kernels are compiled for
+inline constexpr SimulationParams default_params = {};
+
+// Parameter set fixed at compile time. Its members are read like those of
+// SimulationParams, but as constants, so the kernels using it fold them
+template<const SimulationParams& Values>
+struct FixedParams {
+	static constexpr float map_size = Values.map_size;
+	static constexpr float incubating_mass = Values.incubating_mass;
+	static constexpr float hunting_mass = Values.hunting_mass;
+	static constexpr float splitting_mass = Values.splitting_mass;
+	static constexpr float move_mass_cost = Values.move_mass_cost;
+	static constexpr float incubate_mass_reward = Values.incubate_mass_reward;
+	static constexpr float max_eat_distance = Values.max_eat_distance;
+};
@@ -0,0 +1,96 @@
+#include "SlotAllocator.h"
+#include <algorithm>
+#include "AgentBits.h"
+
+SlotAllocator::SlotAllocator(size_t capacity, size_t first_free, int n_threads, bool ordered) :
+	capacity(capacity),
+	ordered(ordered),
+	free_words(ordered ? (capacity + 63) / 64 : 0),
+	caches(n_threads)
+{
+	reset(first_free);
+}
+
+void SlotAllocator::allocate_lowest(size_t count, std::vector<size_t>& slots)
+{
+	for (size_t word = 0; word < free_words.size() && count > 0; word++)
+	{
+		uint64_t bits = free_words[word].load(std::memory_order_relaxed);
+		while (bits != 0 && count > 0)
+		{
+			slots.push_back(word * 64 + AgentBits::lowest_bit(bits));
+			bits &= bits - 1;
+			count--;
+		}
+		free_words[word].store(bits, std::memory_order_relaxed);
+	}
+}
+
+void SlotAllocator::reset(size_t first_free)
+{
+	if (ordered)
+	{
+		for (size_t word = 0; word < free_words.size(); word++)
+		{
+			uint64_t bits = 0;
+			for (size_t slot = std::max(word * 64, first_free); slot < std::min(word * 64 + 64, capacity); slot++)
+			{
+				bits |= uint64_t(1) << (slot % 64);
+			}
+			free_words[word].store(bits, std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	for (ThreadCache& cache : caches)
+	{
+		cache.slots.clear();
+	}
+
+	// Hand out the lowest slots first, so living agents stay packed at the front
+	pool.clear();
+	pool.reserve(capacity - std::min(first_free, capacity));
+	for (size_t slot = capacity; slot > first_free; slot--)
+	{
+		pool.push_back(slot - 1);
+	}
+}
+
+size_t SlotAllocator::allocate(int thread)
+{
+	std::vector<size_t>& cache = caches[thread].slots;
+	if (cache.empty())
+	{
+		std::scoped_lock lock(pool_lock);
+		size_t count = std::min(batch_size, pool.size());
+		// Keep the pool order, the lowest slot ends up at the back of the cache
+		cache.insert(cache.end(), pool.end() - count, pool.end());
+		pool.resize(pool.size() - count);
+	}
+	if (cache.empty())
+	{
+		return no_slot;
+	}
+	size_t slot = cache.back();
+	cache.pop_back();
+	return slot;
+}
+
+void SlotAllocator::release(size_t slot, int thread)
+{
+	if (ordered)
+	{
+		free_words[slot / 64].fetch_or(uint64_t(1) << (slot % 64), std::memory_order_relaxed);
+		return;
+	}
+
+	std::vector<size_t>& cache = caches[thread].slots;
+	cache.push_back(slot);
+	if (cache.size() >= batch_size * 2)
+	{
+		// Give the oldest half back so other threads can use it
+		std::scoped_lock lock(pool_lock);
+		pool.insert(pool.end(), cache.begin(), cache.begin() + batch_size);
+		cache.erase(cache.begin(), cache.begin() + batch_size);
+	}
+}
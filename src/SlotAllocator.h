@@ -0,0 +1,59 @@
+#pragma once
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <atomic>
+#include <cstdint>
+
+// Hands out free agent slots in O(1).
+// Each thread keeps a small cache of free slots and only takes the
+// shared pool lock to refill or flush a whole batch at once.
+// When ordered, free slots are kept as bits instead and always handed
+// out lowest first, whatever thread released them and when.
+class SlotAllocator
+{
+public:
+
+	// Slots [first_free, capacity) start free
+	SlotAllocator(size_t capacity, size_t first_free, int n_threads, bool ordered);
+
+	// A free slot for 'thread', or no_slot if there are none left. Not available when ordered
+	size_t allocate(int thread);
+
+	// The 'count' lowest free slots, in increasing order, appended to 'slots'.
+	// Fewer are appended if there aren't enough. Only available when ordered, not thread-safe
+	void allocate_lowest(size_t count, std::vector<size_t>& slots);
+
+	// Slot is free again and can be handed out right away
+	void release(size_t slot, int thread);
+
+	// Forget every free slot, slots [first_free, capacity) are the free ones now.
+	// Not thread-safe
+	void reset(size_t first_free);
+
+	// Slots moved between a thread cache and the shared pool at once
+	static constexpr size_t batch_size = 64;
+
+	static constexpr size_t no_slot = std::numeric_limits<size_t>::max();
+
+private:
+
+	// Padded so two threads never write the same cache line
+	struct alignas(64) ThreadCache {
+		std::vector<size_t> slots;
+	};
+
+	size_t capacity;
+
+	bool ordered;
+
+	// One bit per free slot, only used when ordered
+	std::vector<std::atomic<uint64_t>> free_words;
+
+	std::vector<ThreadCache> caches;
+
+	std::mutex pool_lock;
+
+	// Free slots not cached by any thread, lowest slots at the back
+	std::vector<size_t> pool;
+};
@@ -1,39 +1,68 @@
 #include "SpatialIndex.h"
 
-SpatialIndex::SpatialIndex(float map_size) : map_size(map_size)
+SpatialIndex::SpatialIndex(float map_size, int divisions, size_t capacity, IndexLocking locking) :
+	divisions_per_dimension(std::clamp(divisions, 1, max_divisions_per_dimension)),
+	map_size(map_size),
+	locking(locking),
+	chunk_locks(divisions_per_dimension * divisions_per_dimension),
+	slots(capacity),
+	agent_partitions(capacity),
+	agent_chunks(capacity)
 {
 	divisions_over_two = divisions_per_dimension / 2;
 	chunk_size = (map_size * 2.0f) / divisions_per_dimension;
 
 	for (int i = 0; i < divisions_per_dimension * divisions_per_dimension; i++)
 	{
-		chunks.push_back(std::vector<size_t>());
+		chunks.push_back(Chunk());
 	}
 }
 
-void SpatialIndex::set(size_t index, vec2f position)
+void SpatialIndex::set(size_t index, vec2f position, State state)
 {
-	std::scoped_lock(critial_region);
-	chunks.at(chunk_index(position)).push_back(index);
+	int new_chunk_index = chunk_index(position);
+	std::scoped_lock lock(chunk_lock(new_chunk_index));
+	insert_into_chunk(index, position, new_chunk_index, partition_of(state));
 }
 
-void SpatialIndex::remove(size_t index, vec2f position)
+void SpatialIndex::remove_all(std::vector<size_t>& agents)
 {
-	std::scoped_lock(critial_region);
-	int old_chunk_index = chunk_index(position);
-	auto& old_chunk = chunks.at(old_chunk_index);
-	auto remove_it = std::find(old_chunk.begin(), old_chunk.end(), index);
-	if (remove_it != old_chunk.end())
+	#pragma omp single
 	{
-		old_chunk.erase(remove_it);
+		// Group the agents by chunk, in index order so the chunks end up the same every run
+		std::sort(agents.begin(), agents.end(), [this](size_t lhs, size_t rhs)
+		{
+			return agent_chunks[lhs] != agent_chunks[rhs] ? agent_chunks[lhs] < agent_chunks[rhs] : lhs < rhs;
+		});
+
+		removal_starts.clear();
+		for (size_t k = 0; k < agents.size(); k++)
+		{
+			if (k == 0 || agent_chunks[agents[k]] != agent_chunks[agents[k - 1]])
+			{
+				removal_starts.push_back(k);
+			}
+		}
+		removal_starts.push_back(agents.size());
+	}
+
+	#pragma omp for schedule(dynamic, 16)
+	for (int group = 0; group < (int)removal_starts.size() - 1; group++)
+	{
+		const int chunk = agent_chunks[agents[removal_starts[group]]];
+		if (chunk == no_chunk)
+		{
+			continue;
+		}
+		for (size_t k = removal_starts[group]; k < removal_starts[group + 1]; k++)
+		{
+			erase_from_chunk(agents[k], chunk);
+		}
 	}
-	return;
 }
 
 void SpatialIndex::moved(size_t index, vec2f old_position, vec2f new_position)
 {
-	std::scoped_lock(critial_region);
-
 	int old_chunk_index = chunk_index(old_position);
 	int new_chunk_index = chunk_index(new_position);
 
@@ -43,27 +72,130 @@ void SpatialIndex::moved(size_t index, vec2f old_position, vec2f new_position)
 		return;
 	}
 
+	if (locking == IndexLocking::Global)
+	{
+		std::scoped_lock lock(critial_region);
+		move_between_chunks(index, new_position, old_chunk_index, new_chunk_index);
+		return;
+	}
+
+	// Always take the lower chunk lock first, so two agents crossing
+	// the same border in opposite directions can't deadlock
+	std::scoped_lock first_lock(chunk_locks[std::min(old_chunk_index, new_chunk_index)]);
+	std::scoped_lock second_lock(chunk_locks[std::max(old_chunk_index, new_chunk_index)]);
+	move_between_chunks(index, new_position, old_chunk_index, new_chunk_index);
+}
+
+void SpatialIndex::changed_state(size_t index, vec2f position, State state)
+{
+	int new_chunk_index = chunk_index(position);
+	int old_chunk_index = agent_chunks[index] == no_chunk ? new_chunk_index : agent_chunks[index];
+
+	if (old_chunk_index == new_chunk_index || locking == IndexLocking::Global)
+	{
+		std::scoped_lock lock(chunk_lock(new_chunk_index));
+		erase_from_chunk(index, old_chunk_index);
+		insert_into_chunk(index, position, new_chunk_index, partition_of(state));
+		return;
+	}
+
+	std::scoped_lock first_lock(chunk_locks[std::min(old_chunk_index, new_chunk_index)]);
+	std::scoped_lock second_lock(chunk_locks[std::max(old_chunk_index, new_chunk_index)]);
+	erase_from_chunk(index, old_chunk_index);
+	insert_into_chunk(index, position, new_chunk_index, partition_of(state));
+}
+
+void SpatialIndex::remap(const std::vector<size_t>& new_indices)
+{
+	#pragma omp single
+	{
+		std::fill(slots.begin(), slots.end(), no_slot);
+		std::fill(agent_chunks.begin(), agent_chunks.end(), no_chunk);
+	}
+
+	// Each agent is in a single chunk, so chunks can be remapped in parallel
+	#pragma omp for
+	for (int chunk = 0; chunk < chunks.size(); chunk++)
 	{
-		// Remove from old chunk
-		auto& old_chunk = chunks.at(old_chunk_index);
-		auto remove_it = std::find(old_chunk.begin(), old_chunk.end(), index);
-		if (remove_it == old_chunk.end())
+		for (int partition = 0; partition < n_partitions; partition++)
 		{
-			// Must be new splitted agent, we should just assign it a new chunk
-			int new_chunk_index = chunk_index(new_position);
-			chunks.at(new_chunk_index).push_back(index);
-			return;
+			std::vector<size_t>& ids = chunks[chunk].partitions[partition].ids;
+			for (size_t slot = 0; slot < ids.size(); slot++)
+			{
+				size_t index = new_indices[ids[slot]];
+				ids[slot] = index;
+				slots[index] = slot;
+				agent_partitions[index] = partition;
+				agent_chunks[index] = chunk;
+			}
 		}
-		old_chunk.erase(remove_it);
-		// Add to new chunk
-		int new_chunk_index = chunk_index(new_position);
-		chunks.at(new_chunk_index).push_back(index);
 	}
 }
 
-const std::vector<size_t>& SpatialIndex::close_to(vec2f position)
+void SpatialIndex::clear_agents(size_t begin, size_t end)
+{
+	end = std::min(end, slots.size());
+	for (size_t i = begin; i < end; i++)
+	{
+		slots[i] = no_slot;
+		agent_partitions[i] = 0;
+		agent_chunks[i] = no_chunk;
+	}
+}
+
+void SpatialIndex::move_between_chunks(size_t index, vec2f new_position, int old_chunk_index, int new_chunk_index)
+{
+	int partition = agent_partitions[index];
+	// Remove from old chunk
+	erase_from_chunk(index, old_chunk_index);
+	// Add to new chunk
+	insert_into_chunk(index, new_position, new_chunk_index, partition);
+}
+
+void SpatialIndex::insert_into_chunk(size_t index, vec2f position, int chunk_index, int partition)
 {
-	return chunks.at(chunk_index(position));
+	Partition& agents = chunks[chunk_index].partitions[partition];
+	slots[index] = agents.ids.size();
+	agent_partitions[index] = partition;
+	agent_chunks[index] = chunk_index;
+	agents.ids.push_back(index);
+	agents.x.push_back(position.x);
+	agents.y.push_back(position.y);
+}
+
+bool SpatialIndex::erase_from_chunk(size_t index, int chunk_index)
+{
+	size_t slot = slots[index];
+	if (slot == no_slot)
+	{
+		return false;
+	}
+	Partition& agents = chunks[chunk_index].partitions[agent_partitions[index]];
+	size_t last_agent = agents.ids.back();
+	agents.ids[slot] = last_agent;
+	agents.x[slot] = agents.x.back();
+	agents.y[slot] = agents.y.back();
+	slots[last_agent] = slot;
+	agents.ids.pop_back();
+	agents.x.pop_back();
+	agents.y.pop_back();
+	slots[index] = no_slot;
+	agent_chunks[index] = no_chunk;
+	return true;
+}
+
+int SpatialIndex::partition_of(State state)
+{
+	return state == State::Hunting ? 1 : 0;
+}
+
+int SpatialIndex::auto_divisions(float map_size, float interaction_distance, size_t expected_agents)
+{
+	float map_area = (map_size * 2.0f) * (map_size * 2.0f);
+	float area_per_agent = map_area / std::max(expected_agents, (size_t)1);
+	float target_chunk_size = std::max(std::sqrt(area_per_agent * target_agents_per_chunk), interaction_distance);
+	int divisions = (int)((map_size * 2.0f) / target_chunk_size);
+	return std::clamp(divisions, 1, max_divisions_per_dimension);
 }
 
 int SpatialIndex::chunk_index(vec2f position)
@@ -74,3 +206,12 @@ int SpatialIndex::chunk_index(vec2f position)
 	int y_pos = std::min((int)(position.y / chunk_size), divisions_per_dimension - 1);
 	return x_pos + y_pos * divisions_per_dimension;
 }
+
+std::mutex& SpatialIndex::chunk_lock(int chunk)
+{
+	if (locking == IndexLocking::Global)
+	{
+		return critial_region;
+	}
+	return chunk_locks[chunk];
+}
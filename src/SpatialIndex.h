@@ -4,29 +4,70 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include "vec2f.h"
+#include "AgentRange.h"
+#include "State.h"
+#include "AlignedAllocator.h"
 
-// Thread-safe spatial index
+// How the spatial index guards concurrent updates
+enum class IndexLocking {
+	Global,		// One lock for the whole index
+	PerChunk	// One lock per chunk, moves between chunks lock both in index order
+};
+
+// Thread-safe spatial index.
+// Each chunk keeps incubating and hunting agents in separate vectors,
+// so a hunter looking for prey only touches incubating agents.
+// The position an agent was indexed at is stored next to it. Incubating
+// agents don't move, so for them it is always their current position.
 class SpatialIndex
 {
 public:
 
-	SpatialIndex(float map_size);
+	SpatialIndex(float map_size, int divisions, size_t capacity, IndexLocking locking);
+
+	// Grid resolution that keeps around 'target_agents_per_chunk' agents in each chunk
+	// for the expected number of agents, without making chunks smaller than the interaction distance.
+	static int auto_divisions(float map_size, float interaction_distance, size_t expected_agents);
 
-	// New agent 'index' is at position
-	void set(size_t index, vec2f position);
+	// New agent 'index' in 'state' is at position
+	void set(size_t index, vec2f position, State state);
 
-	// Remove agent 'index'
-	void remove(size_t index, vec2f position);
+	// Remove every agent in 'agents', which is reordered. Each chunk is handled by a single thread,
+	// so no locks are taken. Called by every thread of the team, no other operation can run at the same time
+	void remove_all(std::vector<size_t>& agents);
 
 	// Agent 'index' moved from old_position to new_position
 	void moved(size_t index, vec2f old_position, vec2f new_position);
 
-	const std::vector<size_t>& close_to(vec2f position);
+	// Agent 'index' changed to 'state' and may have moved to position since it was indexed
+	void changed_state(size_t index, vec2f position, State state);
+
+	// Agents were moved to new indices, new_indices[old index] is the new one.
+	// Called by every thread of the team, no other operation can run at the same time
+	void remap(const std::vector<size_t>& new_indices);
+
+	// Mark agents [begin, end) as not indexed, clamped to the capacity. Every agent has to be
+	// marked once before use, the per-agent arrays are left unwritten so this places their pages
+	void clear_agents(size_t begin, size_t end);
+
+	// Call visit(AgentRange) with the agents in 'state' of every chunk overlapping
+	// the square of half side 'radius' around position. A radius of chunk_size visits the 3x3 neighborhood
+	template<typename Visitor>
+	void for_each_near(vec2f position, float radius, State state, Visitor&& visit);
 
 	int chunk_index(vec2f position);
 
-	static constexpr int divisions_per_dimension = 16;
+	// Average number of agents per chunk targeted by auto_divisions
+	static constexpr float target_agents_per_chunk = 8.0f;
+
+	// Upper bound for the grid resolution
+	static constexpr int max_divisions_per_dimension = 1024;
+
+	int divisions_per_dimension;
 
 	int divisions_over_two;
 
@@ -34,10 +75,81 @@ public:
 
 	float map_size;
 
+	IndexLocking locking;
+
 private:
 
+	// Lock guarding the chunk, depends on the locking mode
+	std::mutex& chunk_lock(int chunk);
+
+	// Move agent 'index' between two chunks. Caller must hold the locks of both
+	void move_between_chunks(size_t index, vec2f new_position, int old_chunk_index, int new_chunk_index);
+
+	// Append agent 'index' to a partition of the chunk. Caller must hold the chunk lock
+	void insert_into_chunk(size_t index, vec2f position, int chunk_index, int partition);
+
+	// Swap agent 'index' with the last agent of its partition and pop it.
+	// Returns false if the agent isn't indexed. Caller must hold the chunk lock
+	bool erase_from_chunk(size_t index, int chunk_index);
+
+	// Partition of the chunk agents in 'state' are kept in
+	static int partition_of(State state);
+
+	static constexpr size_t no_slot = std::numeric_limits<size_t>::max();
+
+	static constexpr int n_partitions = 2;
+
+	// Agents of a partition, with the coordinates they were indexed at
+	struct Partition {
+		std::vector<size_t> ids;
+		std::vector<float> x;
+		std::vector<float> y;
+	};
+
+	// Agents of one chunk, split by state
+	struct Chunk {
+		Partition partitions[n_partitions];
+	};
+
 	std::mutex critial_region;
 
-	// Chunks in the index. Each chunk has a vector of agents
-	std::vector<std::vector<size_t>> chunks;
-};
\ No newline at end of file
+	// One lock per chunk, only used with IndexLocking::PerChunk
+	std::vector<std::mutex> chunk_locks;
+
+	// Chunks in the index. Each chunk has a vector of agents per partition
+	std::vector<Chunk> chunks;
+
+	// Position of each agent inside its partition vector, or no_slot if not indexed.
+	// Guarded by the lock of the chunk the agent is in
+	AlignedVector<size_t> slots;
+
+	// Partition each indexed agent is in
+	AlignedVector<uint8_t> agent_partitions;
+
+	// Chunk each agent is in, or no_chunk if not indexed.
+	// Only changes when the agent itself is inserted or erased
+	AlignedVector<int> agent_chunks;
+
+	static constexpr int no_chunk = -1;
+
+	// Where each chunk's agents start in the list given to remove_all
+	std::vector<size_t> removal_starts;
+};
+
+template<typename Visitor>
+void SpatialIndex::for_each_near(vec2f position, float radius, State state, Visitor&& visit)
+{
+	const int partition = partition_of(state);
+	int min_x = std::max((int)((position.x - radius + map_size) / chunk_size), 0);
+	int min_y = std::max((int)((position.y - radius + map_size) / chunk_size), 0);
+	int max_x = std::min((int)((position.x + radius + map_size) / chunk_size), divisions_per_dimension - 1);
+	int max_y = std::min((int)((position.y + radius + map_size) / chunk_size), divisions_per_dimension - 1);
+	for (int y = min_y; y <= max_y; y++)
+	{
+		for (int x = min_x; x <= max_x; x++)
+		{
+			const Partition& agents = chunks[x + y * divisions_per_dimension].partitions[partition];
+			visit(AgentRange(agents.ids.data(), agents.ids.data() + agents.ids.size(), agents.x.data(), agents.y.data()));
+		}
+	}
+}
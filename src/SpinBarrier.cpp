@@ -0,0 +1,43 @@
+#include "SpinBarrier.h"
+#include <thread>
+
+SpinBarrier::SpinBarrier() :
+	arrived(0),
+	generation(0)
+{
+}
+
+void SpinBarrier::reset(int count)
+{
+	this->count = count;
+	spin_limit = (unsigned)count <= std::thread::hardware_concurrency() ? spin_count : 0;
+	arrived.store(0);
+}
+
+void SpinBarrier::wait()
+{
+	const unsigned current = generation.load(std::memory_order_acquire);
+
+	if (arrived.fetch_add(1, std::memory_order_acq_rel) == count - 1)
+	{
+		// Nobody can arrive at the next barrier before the generation changes
+		arrived.store(0, std::memory_order_relaxed);
+		{
+			std::scoped_lock lock(sleep_lock);
+			generation.store(current + 1, std::memory_order_release);
+		}
+		wake_up.notify_all();
+		return;
+	}
+
+	for (int spin = 0; spin < spin_limit; spin++)
+	{
+		if (generation.load(std::memory_order_acquire) != current)
+		{
+			return;
+		}
+	}
+
+	std::unique_lock lock(sleep_lock);
+	wake_up.wait(lock, [&] { return generation.load(std::memory_order_acquire) != current; });
+}
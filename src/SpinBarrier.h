@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Barrier for a fixed team of threads that meets many times per step.
+// Threads spin for a while on the barrier generation, which flips like
+// a sense flag every time the last thread arrives, and then sleep on a
+// condition variable. When there are more threads than cores they sleep
+// right away, since spinning would only take the core from a thread
+// that still has work to do.
+class SpinBarrier
+{
+public:
+
+	SpinBarrier();
+
+	// Team of 'count' threads from now on. Not thread-safe, no thread can be waiting
+	void reset(int count);
+
+	// Block until every thread of the team has called wait
+	void wait();
+
+	// Generation checks before a waiting thread goes to sleep
+	static constexpr int spin_count = 4096;
+
+private:
+
+	int count = 1;
+
+	int spin_limit = 0;
+
+	std::atomic<int> arrived;
+
+	std::atomic<unsigned> generation;
+
+	std::mutex sleep_lock;
+
+	std::condition_variable wake_up;
+};
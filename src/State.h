@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+
+// Possible states for each agent, a byte each
+enum class State : uint8_t {
+	Incubating,	// Standing still and gaining mass
+	Hunting,	// Moving, trying to absorb other agents, spending mass
+	Dead		// Dead
+};
@@ -47,7 +47,7 @@ void Visualization::run()
 
 void Visualization::render_visualization()
 {
-	size_t num_agents = std::min(simulation->positions.size(), (size_t) 1024 * 4);
+	size_t num_agents = std::min(simulation->pos_x.size(), (size_t) 1024 * 4);
 	sf::CircleShape circle;
 	for (int i = 0; i < num_agents; i++)
 	{
@@ -61,8 +61,8 @@ void Visualization::render_visualization()
 		else if (state == State::Incubating) {
 			circle.setFillColor(sf::Color::Blue);
 		}
-		const vec2f& agent_position = simulation->positions[i];
-		const float& agent_size = simulation->masses[i];
+		const vec2f agent_position = simulation->position_of(i);
+		const float agent_size = simulation->mass_of(i);
 		circle.setPosition({ agent_position.x, agent_position.y });
 		circle.setRadius(agent_size);
 		window.draw(circle);
@@ -1,11 +1,13 @@
 #include <SFML/System/Clock.hpp>
 #include <thread>
 #include <optional>
+#include <cstdlib>
 #include "ThirdParty/easylogging/easylogging/easylogging++.h"
 INITIALIZE_EASYLOGGINGPP
 #include "Visualization.h"
 #include "Simulation.h"
 #include "Settings.h"
+#include "Ensemble.h"
 
 int main(int argc, char* argv[])
 {
@@ -18,6 +20,10 @@ int main(int argc, char* argv[])
 
 	// Read args
 	Settings settings(argc, argv);
+	if (!settings.is_valid)
+	{
+		return EXIT_FAILURE;
+	}
 
 	// TODO: Check if works
 	if (settings.debug)
@@ -29,8 +35,21 @@ int main(int argc, char* argv[])
 		el::Loggers::setVerboseLevel(1);
 	}
 
+	// Run every instance of the ensemble instead of a single simulation
+	if (!settings.ensemble.empty())
+	{
+		Ensemble ensemble(argc, argv, settings);
+		const bool ran = ensemble.run();
+		LOG(INFO) << "Total time: " << clock.getElapsedTime().asMilliseconds() << "ms";
+		return ran ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	// Start simulation
 	Simulation simulation(settings);
+	if (!simulation.is_ready)
+	{
+		return EXIT_FAILURE;
+	}
 	std::thread simulation_thread([&]() {
 		simulation.run();
 	});
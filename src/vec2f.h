@@ -1,4 +1,6 @@
 #pragma once
+#include <cmath>
+
 struct vec2f {
 	vec2f() = default;
 	vec2f(float x, float y) : x(x), y(y)
@@ -17,7 +19,9 @@ struct vec2f {
 
 	inline static float squared_distance(vec2f lhs, vec2f rhs)
 	{
-		return pow((lhs.x - rhs.x), 2) + pow((rhs.y - rhs.y), 2);
+		float dx = lhs.x - rhs.x;
+		float dy = lhs.y - rhs.y;
+		return (dx * dx) + (dy * dy);
 	}
 	inline float length() {
 		return sqrt((x * x) + (y * y));